@@ -0,0 +1,553 @@
+#include "AnimationPlayer.h"
+
+#include "ColorManager.h"
+#include "InterruptibleDevice.h"
+#include "Profiler.h"
+#include "StreamBuffer.h"
+#include "framediff.h"
+
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QDebug>
+
+// How much we're allowed to decode ahead
+static const qint64 s_maxQueuedBytes = 256 * 1024 * 1024;
+
+// Some formats (e.g. mng) don't provide a delay, we cap at 60fps
+static const int s_minimumDelay = 16;
+
+// Keyframes are kept every s_keyframeInterval frames, up to this much
+static const qint64 s_maxKeyframeBytes = 64 * 1024 * 1024;
+
+AnimationDecoder::AnimationDecoder(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, QObject *parent) :
+    QThread(parent),
+    m_stream(stream),
+    m_format(format)
+{
+}
+
+AnimationDecoder::~AnimationDecoder()
+{
+    requestInterruption();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_wakeup.wakeAll();
+    }
+    wait();
+}
+
+const AnimationDecoder::Frame *AnimationDecoder::peekFrame(int generation)
+{
+    dropStaleFrames(generation);
+
+    const int readIndex = m_readIndex.loadRelaxed();
+    if (readIndex == m_writeIndex.loadAcquire()) {
+        return nullptr;
+    }
+    return &m_ring[readIndex % s_ringSize];
+}
+
+bool AnimationDecoder::takeFrame(int generation, Frame *frame)
+{
+    if (!peekFrame(generation)) {
+        return false;
+    }
+
+    const int readIndex = m_readIndex.loadRelaxed();
+    Frame &slot = m_ring[readIndex % s_ringSize];
+    m_queuedBytes.fetchAndAddRelaxed(-slot.image.sizeInBytes());
+    *frame = slot;
+    slot = Frame();
+    m_readIndex.storeRelease(readIndex + 1);
+
+    QMutexLocker locker(&m_mutex);
+    m_wakeup.wakeAll();
+    return true;
+}
+
+void AnimationDecoder::dropStaleFrames(int generation)
+{
+    int readIndex = m_readIndex.loadRelaxed();
+    bool dropped = false;
+    while (readIndex != m_writeIndex.loadAcquire()) {
+        Frame &slot = m_ring[readIndex % s_ringSize];
+        if (slot.generation == generation) {
+            break;
+        }
+        m_queuedBytes.fetchAndAddRelaxed(-slot.image.sizeInBytes());
+        slot = Frame();
+        m_readIndex.storeRelease(++readIndex);
+        dropped = true;
+    }
+    if (dropped) {
+        QMutexLocker locker(&m_mutex);
+        m_wakeup.wakeAll();
+    }
+}
+
+void AnimationDecoder::setScaledSize(const QSize &size)
+{
+    QMutexLocker locker(&m_mutex);
+    m_scaledSize = size;
+}
+
+void AnimationDecoder::setDiskCache(const QString &key, const CachedImage &cached)
+{
+    m_diskCacheKey = key;
+    m_cached = cached;
+}
+
+void AnimationDecoder::seek(int frameNumber, int generation)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_seekFrame = frameNumber;
+        m_seekGeneration = generation;
+        m_wakeup.wakeAll();
+    }
+
+    // Make room for the decoder to continue
+    dropStaleFrames(generation);
+}
+
+bool AnimationDecoder::hasRoom() const
+{
+    const int queued = m_writeIndex.loadRelaxed() - m_readIndex.loadAcquire();
+    if (queued >= s_ringSize) {
+        return false;
+    }
+    return queued == 0 || m_queuedBytes.loadAcquire() < s_maxQueuedBytes;
+}
+
+bool AnimationDecoder::isStreaming() const
+{
+    return !m_stream->isFinished();
+}
+
+void AnimationDecoder::openReader()
+{
+    m_reader.reset();
+    m_device.reset();
+    m_file.reset(new StreamDevice(m_stream));
+    m_file->open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    m_device.reset(new InterruptibleDevice(m_file.data(), this));
+    m_device->open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    m_reader.reset(new QImageReader(m_device.data(), m_format));
+
+    // Some readers (e.g. gif) need all the data to count the frames
+    if (!isStreaming() && m_frameCount.loadAcquire() == 0 && m_reader->imageCount() > 0) {
+        m_frameCount.storeRelease(m_reader->imageCount());
+    }
+}
+
+void AnimationDecoder::pushFrame(Frame frame)
+{
+    // Frames in the same generation are shown one after the other
+    if (m_lastPushed.number >= 0 && m_lastPushed.generation == frame.generation) {
+        ProfileScope scope("diff frame");
+        frame.changed = changedRect(m_lastPushed.image, frame.image);
+    } else {
+        frame.changed = frame.image.rect();
+    }
+    m_lastPushed = frame;
+
+    const int writeIndex = m_writeIndex.loadRelaxed();
+    m_ring[writeIndex % s_ringSize] = frame;
+    m_queuedBytes.fetchAndAddRelaxed(frame.image.sizeInBytes());
+    m_writeIndex.storeRelease(writeIndex + 1);
+    emit frameDecoded();
+}
+
+bool AnimationDecoder::findIndexedFrame(int number, Frame *frame) const
+{
+    if (m_keyframes.contains(number)) {
+        *frame = m_keyframes.value(number);
+        return true;
+    }
+    if (m_interval.contains(number)) {
+        *frame = m_interval.value(number);
+        return true;
+    }
+    return false;
+}
+
+void AnimationDecoder::indexFrame(const Frame &frame)
+{
+    if (frame.number % s_keyframeInterval == 0 && !m_keyframes.contains(frame.number) &&
+            m_keyframeBytes + frame.image.sizeInBytes() < s_maxKeyframeBytes) {
+        m_keyframes.insert(frame.number, frame);
+        m_keyframeBytes += frame.image.sizeInBytes();
+    }
+    if (frame.number >= m_intervalStart && frame.number < m_intervalStart + s_keyframeInterval) {
+        m_interval.insert(frame.number, frame);
+    }
+}
+
+bool AnimationDecoder::canUseCached(const QSize &scaledSize) const
+{
+    if (m_cached.frames.isEmpty()) {
+        return false;
+    }
+    const QSize cachedSize = m_cached.frames.first().size();
+    return !scaledSize.isValid() || (scaledSize.width() <= cachedSize.width() && scaledSize.height() <= cachedSize.height());
+}
+
+void AnimationDecoder::storeInDiskCache(const QSize &scaledSize)
+{
+    const int count = m_store.count();
+    int delay = 0;
+    QSize size = m_store.frame(0, &delay).size();
+    CachedImage cached = m_cached;
+    cached.imageSize = size;
+    if (scaledSize.isValid()) {
+        size = scaledSize;
+    }
+    if (qint64(size.width()) * size.height() * 4 * count > DiskCache::maxEntrySize()) {
+        return;
+    }
+
+    for (int i = 0; i < count && !isInterruptionRequested(); i++) {
+        const QImage image = m_store.frame(i, &delay);
+        cached.frames.append(image.size() == size ? image : image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+        cached.delays.append(delay);
+    }
+    if (!isInterruptionRequested()) {
+        DiskCache::store(m_diskCacheKey, cached);
+    }
+}
+
+void AnimationDecoder::run()
+{
+    // Only formats that can seek themselves (e.g. webp, tiff) support this
+    bool canJump = false;
+    if (m_cached.frames.isEmpty()) {
+        openReader();
+        canJump = !isStreaming() && m_reader->jumpToImage(0);
+    } else {
+        m_frameCount.storeRelease(m_cached.frames.count());
+    }
+
+    int frameNumber = 0;
+    int readerFrame = 0; // what m_reader gives us next
+    int generation = 0;
+    int firstQueued = 0; // when seeking we decode up to where we should be without queueing
+
+    while (!isInterruptionRequested()) {
+        QSize scaledSize;
+        int seekTarget = -1;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (frameNumber >= firstQueued && !hasRoom() &&
+                    m_seekGeneration == generation && !isInterruptionRequested()) {
+                m_wakeup.wait(&m_mutex);
+            }
+            if (isInterruptionRequested()) {
+                return;
+            }
+            if (m_seekGeneration != generation) {
+                generation = m_seekGeneration;
+                seekTarget = m_seekFrame;
+            }
+            scaledSize = m_scaledSize;
+        }
+
+        if (scaledSize != m_indexedSize) {
+            m_keyframes.clear();
+            m_keyframeBytes = 0;
+            m_interval.clear();
+            m_indexedSize = scaledSize;
+        }
+        m_indexedBytes.storeRelaxed(m_keyframeBytes + m_store.sizeInBytes());
+
+        if (!m_cached.frames.isEmpty() && !canUseCached(scaledSize)) {
+            // Zoomed in past what was cached, continue from the real thing
+            m_cached.frames.clear();
+            m_cached.delays.clear();
+            openReader();
+            readerFrame = 0;
+            canJump = !isStreaming() && m_reader->jumpToImage(0);
+            firstQueued = qMax(firstQueued, frameNumber);
+            frameNumber = firstQueued;
+        }
+
+        if (seekTarget >= 0) {
+            const int count = m_frameCount.loadAcquire();
+            firstQueued = count > 0 ? seekTarget % count : seekTarget;
+
+            // Keep the whole interval around where we are, so stepping
+            // backwards doesn't need to decode from the start every time.
+            const int intervalStart = firstQueued - firstQueued % s_keyframeInterval;
+            if (intervalStart != m_intervalStart) {
+                m_intervalStart = intervalStart;
+                m_interval.clear();
+            }
+
+            Frame frame;
+            if (findIndexedFrame(firstQueued, &frame)) {
+                frame.generation = generation;
+                pushFrame(frame);
+                firstQueued++;
+                if (count > 0) {
+                    firstQueued %= count;
+                }
+            }
+
+            // The frames before it come from the store, or the reader
+            // catches up below
+            frameNumber = firstQueued;
+            continue;
+        }
+
+        ProfileScope scope("decode frame");
+        scope.setArg("frame", frameNumber);
+        scope.setArg("stored", m_store.isComplete() || frameNumber < m_store.count());
+        scope.setArg("cached", !m_cached.frames.isEmpty());
+
+        QElapsedTimer timer;
+        timer.start();
+        QImage image;
+        int delay = 0;
+        int number = frameNumber;
+        if (!m_cached.frames.isEmpty()) {
+            if (frameNumber >= m_cached.frames.count()) {
+                frameNumber = 0;
+                firstQueued = firstQueued % m_cached.frames.count();
+                continue;
+            }
+            image = m_cached.frames[frameNumber];
+            delay = m_cached.delays[frameNumber];
+        } else if (m_store.isComplete()) {
+            if (frameNumber >= m_store.count()) {
+                frameNumber = 0;
+                firstQueued = firstQueued % m_store.count();
+                continue;
+            }
+            image = m_store.frame(frameNumber, &delay);
+        } else if (frameNumber < m_store.count()) {
+            // The store has everything the reader has given us so far at
+            // full size, so seeking back into it doesn't need the reader.
+            image = m_store.frame(frameNumber, &delay);
+        } else {
+            // Decoding up to it is cheaper than jumping if it's close
+            if (canJump && readerFrame != frameNumber &&
+                    (readerFrame > frameNumber || frameNumber - readerFrame >= s_keyframeInterval) &&
+                    m_reader->jumpToImage(frameNumber)) {
+                readerFrame = frameNumber;
+            } else if (readerFrame > frameNumber) {
+                // Only if the store gave up, most formats can only be decoded from the start
+                openReader();
+                readerFrame = 0;
+            }
+
+            if (!m_reader->read(&image)) {
+                if (isInterruptionRequested()) {
+                    return;
+                }
+                if (readerFrame == 0) {
+                    emit decodeFailed(m_reader->errorString());
+                    return;
+                }
+
+                // Reached the end, loop
+                m_frameCount.storeRelease(readerFrame);
+                firstQueued = firstQueued % readerFrame;
+                frameNumber = 0;
+                if (m_store.count() == m_frameCount.loadRelaxed()) {
+                    m_store.setComplete();
+                }
+                if (m_store.isComplete()) {
+                    if (!m_diskCacheKey.isEmpty()) {
+                        storeInDiskCache(scaledSize);
+                        m_diskCacheKey.clear();
+                    }
+                    m_reader.reset();
+                    m_device.reset();
+                    m_file.reset();
+                } else {
+                    openReader();
+                }
+                readerFrame = 0;
+                continue;
+            }
+
+            // Before storing it, so looping doesn't convert it again
+            if (m_colorManaged) {
+                ColorManager::convert(&image);
+            }
+            delay = m_reader->nextImageDelay();
+            number = readerFrame++;
+            if (number == m_store.count()) {
+                m_store.append(image, delay);
+            }
+        }
+
+        // Frames the reader decodes on the way to frameNumber are only indexed
+        const bool catchingUp = number < frameNumber;
+        if (!catchingUp) {
+            frameNumber++;
+        }
+
+        Frame frame;
+        frame.number = number;
+        frame.delay = delay;
+        frame.generation = generation;
+        frame.decodeTime = timer.nsecsElapsed() / 1000;
+
+        const bool queue = !catchingUp && frame.number >= firstQueued;
+        const bool index = frame.number % s_keyframeInterval == 0 ||
+            (frame.number >= m_intervalStart && frame.number < m_intervalStart + s_keyframeInterval);
+        if (!queue && !index) {
+            continue;
+        }
+
+        if (scaledSize.isValid() && image.size() != scaledSize) {
+            ProfileScope scaleScope("scale frame");
+            timer.restart();
+            frame.image = image.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            frame.scaleTime = timer.nsecsElapsed() / 1000;
+        } else {
+            frame.image = image;
+        }
+        if (index) {
+            indexFrame(frame);
+        }
+        if (queue) {
+            pushFrame(frame);
+            // Got to where we seeked, so the next loop plays from the start
+            firstQueued = 0;
+        }
+    }
+}
+
+AnimationPlayer::AnimationPlayer(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, QObject *parent) :
+    QObject(parent),
+    m_format(format),
+    m_decoder(new AnimationDecoder(stream, format))
+{
+    m_clock.start();
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout, this, &AnimationPlayer::showNextFrame);
+    connect(m_decoder.data(), &AnimationDecoder::frameDecoded, this, &AnimationPlayer::onFrameDecoded);
+    connect(m_decoder.data(), &AnimationDecoder::decodeFailed, this, &AnimationPlayer::onDecodeFailed);
+}
+
+AnimationPlayer::~AnimationPlayer()
+{
+}
+
+void AnimationPlayer::start()
+{
+    if (m_state == Running) {
+        return;
+    }
+    if (!m_decoder->isRunning() && !m_decoder->isFinished()) {
+        m_decoder->start();
+    }
+    m_state = Running;
+    if (m_current.number < 0 || m_waitingForFrame) {
+        showNextFrame();
+    } else {
+        m_timer.start(nextFrameDelay());
+    }
+}
+
+void AnimationPlayer::setPaused(bool paused)
+{
+    if (paused) {
+        if (m_state == Running) {
+            m_state = Paused;
+        }
+        m_timer.stop();
+        return;
+    }
+    start();
+}
+
+void AnimationPlayer::setScaledSize(const QSize &size)
+{
+    // Already queued frames are stretched when painted until new ones arrive
+    m_scaledSize = size;
+    m_decoder->setScaledSize(size);
+}
+
+int AnimationPlayer::nextFrameDelay() const
+{
+    return qMax(m_current.delay * 100 / qMax(m_speed, 1), s_minimumDelay);
+}
+
+bool AnimationPlayer::jumpToFrame(int frameNumber)
+{
+    const int count = frameCount();
+    if (count > 0) {
+        frameNumber = ((frameNumber % count) + count) % count;
+    } else if (frameNumber < 0) {
+        return false;
+    }
+    m_timer.stop();
+
+    // Stepping forward is usually already decoded
+    const AnimationDecoder::Frame *next = m_decoder->peekFrame(m_generation);
+    if (next && next->number == frameNumber) {
+        showNextFrame();
+        return true;
+    }
+
+    m_generation++;
+    m_decoder->seek(frameNumber, m_generation);
+    m_waitingForFrame = true;
+    return true;
+}
+
+void AnimationPlayer::showNextFrame()
+{
+    AnimationDecoder::Frame frame;
+    if (!m_decoder->takeFrame(m_generation, &frame)) {
+        // Decoder is behind, show it as soon as it's ready
+        if (!m_waitingForFrame && m_state == Running && m_current.number >= 0) {
+            m_lateFrames++;
+        }
+        m_waitingForFrame = true;
+        return;
+    }
+    m_waitingForFrame = false;
+
+    const qint64 now = m_clock.elapsed();
+    if (m_lastShownAt >= 0 && m_state == Running) {
+        m_actualInterval = now - m_lastShownAt;
+        m_requestedInterval = nextFrameDelay();
+    }
+    m_lastShownAt = now;
+
+    if (Profiler::isEnabled()) {
+        // How long the previous frame actually was shown, versus its delay
+        if (m_frameShownAt >= 0) {
+            Profiler::addSpan("frame", m_frameShownAt, {
+                { "frame", m_current.number },
+                { "delay", nextFrameDelay() }
+            });
+        }
+        m_frameShownAt = Profiler::now();
+    }
+
+    m_current = frame;
+    emit frameChanged(m_current.number);
+
+    if (m_state == Running) {
+        m_timer.start(nextFrameDelay());
+    }
+}
+
+void AnimationPlayer::onFrameDecoded()
+{
+    if (m_waitingForFrame) {
+        showNextFrame();
+    }
+}
+
+void AnimationPlayer::onDecodeFailed(const QString &message)
+{
+    m_failed = m_current.number < 0;
+    m_timer.stop();
+    m_state = NotRunning;
+    emit error(message);
+}
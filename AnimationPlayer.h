@@ -0,0 +1,207 @@
+#pragma once
+
+#include "FrameStore.h"
+#include "DiskCache.h"
+
+#include <QObject>
+#include <QThread>
+#include <QImage>
+#include <QTimer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QScopedPointer>
+#include <QHash>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+
+class QImageReader;
+class QIODevice;
+class StreamBuffer;
+
+// Decodes frames ahead of time in a separate thread, and scales them to the
+// size we show them at. The frames are handed over in a ring buffer that is
+// bounded both in number of frames and bytes.
+class AnimationDecoder : public QThread
+{
+    Q_OBJECT
+
+public:
+    struct Frame {
+        QImage image;
+        int number = -1;
+        int delay = 0;
+        int generation = 0;
+        // Where it differs from the frame queued before it
+        QRect changed;
+        // In microseconds
+        qint64 decodeTime = 0;
+        qint64 scaleTime = 0;
+    };
+
+    AnimationDecoder(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, QObject *parent = nullptr);
+    ~AnimationDecoder();
+
+    // Call before starting. If cached has frames they are played instead of
+    // decoding, until they are too small for the scaled size. Otherwise the
+    // scaled frames are stored once we have decoded all of them.
+    void setDiskCache(const QString &key, const CachedImage &cached);
+    // Call before starting, ColorManager needs to be initialized
+    void setColorManaged(bool colorManaged) { m_colorManaged = colorManaged; }
+
+    // These are only called from the GUI thread
+    const Frame *peekFrame(int generation);
+    bool takeFrame(int generation, Frame *frame);
+    void setScaledSize(const QSize &size);
+    void seek(int frameNumber, int generation);
+
+    // 0 until we know
+    int frameCount() const { return m_frameCount.loadAcquire(); }
+
+    // Queued and indexed frames, roughly
+    qint64 memoryUsage() const { return m_queuedBytes.loadRelaxed() + m_indexedBytes.loadRelaxed(); }
+
+signals:
+    void frameDecoded();
+    void decodeFailed(const QString &error);
+
+protected:
+    void run() override;
+
+private:
+    void openReader();
+    bool isStreaming() const;
+    bool hasRoom() const;
+    void dropStaleFrames(int generation);
+    void pushFrame(Frame frame);
+    bool findIndexedFrame(int number, Frame *frame) const;
+    void indexFrame(const Frame &frame);
+    bool canUseCached(const QSize &scaledSize) const;
+    void storeInDiskCache(const QSize &scaledSize);
+
+    const QSharedPointer<StreamBuffer> m_stream;
+    const QByteArray m_format;
+
+    // Only touched by the decoding thread
+    QScopedPointer<QImageReader> m_reader;
+    QScopedPointer<QIODevice> m_file;
+    QScopedPointer<QIODevice> m_device;
+
+    // Decoded frames we can seek to directly: every s_keyframeInterval'th
+    // frame, and all the frames in the interval we last seeked into.
+    static const int s_keyframeInterval = 16;
+    QHash<int, Frame> m_keyframes;
+    qint64 m_keyframeBytes = 0;
+    QHash<int, Frame> m_interval;
+    int m_intervalStart = -s_keyframeInterval;
+    QSize m_indexedSize;
+
+    // All the frames the reader has given us at full size, so seeking back
+    // only costs one of its keyframe intervals. When it is complete we stop
+    // decoding.
+    FrameStore m_store;
+
+    QString m_diskCacheKey;
+    CachedImage m_cached;
+    bool m_colorManaged = false;
+
+    // Single producer and single consumer, the indices only ever increase
+    static const int s_ringSize = 32;
+    Frame m_ring[s_ringSize];
+    // To find what changed in the next one
+    Frame m_lastPushed;
+    QAtomicInt m_readIndex;
+    QAtomicInt m_writeIndex;
+    QAtomicInteger<qint64> m_queuedBytes;
+    QAtomicInteger<qint64> m_indexedBytes;
+
+    QAtomicInt m_frameCount;
+
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    QSize m_scaledSize;
+    int m_seekFrame = 0;
+    int m_seekGeneration = 0;
+};
+
+// Plays back the frames from the decoder, mostly the same API as QMovie.
+class AnimationPlayer : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum State {
+        NotRunning,
+        Paused,
+        Running
+    };
+    Q_ENUM(State)
+
+    AnimationPlayer(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, QObject *parent = nullptr);
+    ~AnimationPlayer();
+
+    bool isValid() const { return !m_failed; }
+    QByteArray format() const { return m_format; }
+    State state() const { return m_state; }
+
+    void start();
+    void setPaused(bool paused);
+
+    int speed() const { return m_speed; }
+    void setSpeed(int percentSpeed) { m_speed = percentSpeed; }
+
+    QSize scaledSize() const { return m_scaledSize; }
+    void setScaledSize(const QSize &size);
+
+    void setDiskCache(const QString &key, const CachedImage &cached) { m_decoder->setDiskCache(key, cached); }
+    void setColorManaged(bool colorManaged) { m_decoder->setColorManaged(colorManaged); }
+
+    QImage currentImage() const { return m_current.image; }
+    int currentFrameNumber() const { return m_current.number; }
+    // The whole frame if the previous one wasn't the one before it
+    QRect currentChangedRect() const { return m_current.changed; }
+    qint64 currentDecodeTime() const { return m_current.decodeTime; }
+    qint64 currentScaleTime() const { return m_current.scaleTime; }
+
+    // How long the previous frame was actually shown, versus what it asked
+    // for, in ms
+    int actualInterval() const { return m_actualInterval; }
+    int requestedInterval() const { return m_requestedInterval; }
+    // Frames that weren't decoded in time to be shown when they should
+    int lateFrames() const { return m_lateFrames; }
+    qint64 memoryUsage() const { return m_decoder->memoryUsage(); }
+    int nextFrameDelay() const;
+    int frameCount() const { return m_decoder->frameCount(); }
+
+    bool jumpToFrame(int frameNumber);
+
+signals:
+    void frameChanged(int frameNumber);
+    void error(const QString &error);
+
+private slots:
+    void showNextFrame();
+    void onFrameDecoded();
+    void onDecodeFailed(const QString &message);
+
+private:
+    const QByteArray m_format;
+    QScopedPointer<AnimationDecoder> m_decoder;
+    QTimer m_timer;
+
+    AnimationDecoder::Frame m_current;
+    int m_generation = 0;
+    bool m_waitingForFrame = false;
+    qint64 m_frameShownAt = -1;
+    bool m_failed = false;
+
+    QElapsedTimer m_clock;
+    qint64 m_lastShownAt = -1;
+    int m_actualInterval = 0;
+    int m_requestedInterval = 0;
+    int m_lateFrames = 0;
+
+    State m_state = NotRunning;
+    int m_speed = 100;
+    QSize m_scaledSize;
+};
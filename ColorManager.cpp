@@ -0,0 +1,235 @@
+#include "ColorManager.h"
+
+#include "colorlut.h"
+#include "Profiler.h"
+
+#include <QColorTransform>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QX11Info>
+#include <QDebug>
+
+#include <xcb/xcb.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char s_magic[4] = { 'Q', 'E', 'H', 'L' };
+static const qint32 s_version = 1;
+
+// Guards everything below
+static QMutex s_mutex;
+static QColorSpace s_display;
+static QByteArray s_displayKey;
+static QHash<QByteArray, QSharedPointer<const ColorLut>> s_luts;
+
+namespace {
+struct LutHeader {
+    char magic[4];
+    qint32 version;
+    qint32 gridSize;
+};
+}
+
+static QColorSpace rootWindowColorSpace()
+{
+    if (!QX11Info::isPlatformX11()) {
+        return QColorSpace();
+    }
+    xcb_connection_t *connection = QX11Info::connection();
+    static const char name[] = "_ICC_PROFILE";
+    xcb_intern_atom_reply_t *atom = xcb_intern_atom_reply(connection,
+            xcb_intern_atom(connection, true, sizeof(name) - 1, name), nullptr);
+    if (!atom) {
+        return QColorSpace();
+    }
+    const xcb_atom_t property = atom->atom;
+    free(atom);
+    if (property == XCB_ATOM_NONE) {
+        // Nothing has set a profile
+        return QColorSpace();
+    }
+
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(connection,
+            xcb_get_property(connection, false, QX11Info::appRootWindow(), property, XCB_ATOM_CARDINAL, 0, 4 * 1024 * 1024), nullptr);
+    if (!reply) {
+        return QColorSpace();
+    }
+    const QByteArray profile(static_cast<const char*>(xcb_get_property_value(reply)),
+            xcb_get_property_value_length(reply) * (reply->format / 8));
+    free(reply);
+
+    const QColorSpace colorSpace = QColorSpace::fromIccProfile(profile);
+    if (!colorSpace.isValid() && !profile.isEmpty()) {
+        qWarning() << "Unsupported display profile, using sRGB";
+    }
+    return colorSpace;
+}
+
+static QString lutDirectory()
+{
+    // Next to the disk cache
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QStringLiteral("/qeh");
+}
+
+static QByteArray colorSpaceData(const QColorSpace &colorSpace)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << colorSpace;
+    return data;
+}
+
+void ColorManager::initialize()
+{
+    QMutexLocker locker(&s_mutex);
+    if (!s_display.isValid()) {
+        s_display = rootWindowColorSpace();
+        if (!s_display.isValid()) {
+            s_display = QColorSpace(QColorSpace::SRgb);
+        }
+        s_displayKey = QCryptographicHash::hash(colorSpaceData(s_display), QCryptographicHash::Sha1);
+    }
+}
+
+QByteArray ColorManager::displayKey()
+{
+    QMutexLocker locker(&s_mutex);
+    return s_displayKey;
+}
+
+QColorSpace ColorManager::displayColorSpace()
+{
+    QMutexLocker locker(&s_mutex);
+    return s_display;
+}
+
+bool ColorManager::loadLut(const QString &path, ColorLut *lut)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const int entries = ColorLut::s_gridSize * ColorLut::s_gridSize * ColorLut::s_gridSize * 4;
+    const QByteArray data = file.readAll();
+    LutHeader header;
+    if (data.size() != int(sizeof(header) + entries * sizeof(qint16))) {
+        return false;
+    }
+    memcpy(&header, data.constData(), sizeof(header));
+    if (memcmp(header.magic, s_magic, sizeof(s_magic)) != 0 || header.version != s_version ||
+            header.gridSize != ColorLut::s_gridSize) {
+        return false;
+    }
+    lut->table.resize(entries);
+    memcpy(lut->table.data(), data.constData() + sizeof(header), entries * sizeof(qint16));
+    return true;
+}
+
+void ColorManager::storeLut(const QString &path, const ColorLut &lut)
+{
+    QDir().mkpath(QFileInfo(path).path());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    LutHeader header;
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.gridSize = ColorLut::s_gridSize;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(lut.table.constData()), lut.table.size() * sizeof(qint16));
+    if (!file.commit()) {
+        qWarning() << "Failed to store color lookup table" << path << file.errorString();
+    }
+}
+
+QSharedPointer<const ColorLut> ColorManager::lut(const QColorSpace &source, const QColorSpace &display)
+{
+    const QByteArray key = QCryptographicHash::hash(colorSpaceData(source) + colorSpaceData(display), QCryptographicHash::Sha1).toHex();
+
+    // Other threads usually want the same one, so they can wait for it
+    QMutexLocker locker(&s_mutex);
+    QSharedPointer<const ColorLut> cached = s_luts.value(key);
+    if (cached) {
+        return cached;
+    }
+
+    QSharedPointer<ColorLut> lut(new ColorLut);
+    const QString path = lutDirectory() + QLatin1Char('/') + QString::fromLatin1(key) + QStringLiteral(".lut");
+    if (!loadLut(path, lut.data())) {
+        ProfileScope scope("build color lut");
+        const QColorTransform transform = source.transformationToColorSpace(display);
+        const int size = ColorLut::s_gridSize;
+        lut->table.resize(size * size * size * 4);
+        qint16 *entry = lut->table.data();
+        for (int r = 0; r < size; r++) {
+            for (int g = 0; g < size; g++) {
+                for (int b = 0; b < size; b++) {
+                    const QRgba64 color = transform.map(QRgba64::fromRgba64(
+                                r * 65535 / (size - 1), g * 65535 / (size - 1), b * 65535 / (size - 1), 65535));
+                    entry[0] = (qint64(color.blue()) * 255 * 128 + 32767) / 65535;
+                    entry[1] = (qint64(color.green()) * 255 * 128 + 32767) / 65535;
+                    entry[2] = (qint64(color.red()) * 255 * 128 + 32767) / 65535;
+                    entry[3] = 0;
+                    entry += 4;
+                }
+            }
+        }
+        storeLut(path, *lut);
+    }
+    initLutIndices(lut.data());
+    s_luts.insert(key, lut);
+    return lut;
+}
+
+void ColorManager::convert(QImage *image)
+{
+    const QColorSpace display = displayColorSpace();
+    if (!display.isValid() || image->isNull()) {
+        return;
+    }
+    QColorSpace source = image->colorSpace();
+    if (!source.isValid()) {
+        source = QColorSpace(QColorSpace::SRgb);
+    }
+    if (source == display) {
+        return;
+    }
+    const QSharedPointer<const ColorLut> table = lut(source, display);
+
+    ProfileScope scope("color convert");
+    scope.setArg("pixels", image->width() * image->height());
+    switch (image->format()) {
+    case QImage::Format_Indexed8: {
+        // Only the palette
+        QVector<QRgb> colors = image->colorTable();
+        applyColorLut(*table, colors.data(), colors.count());
+        image->setColorTable(colors);
+        break;
+    }
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+        applyColorLut(*table, image);
+        break;
+    case QImage::Format_ARGB32_Premultiplied:
+        // The table is for the colours, not the colours times alpha
+        *image = image->convertToFormat(QImage::Format_ARGB32);
+        applyColorLut(*table, image);
+        *image = image->convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        break;
+    default:
+        *image = image->convertToFormat(image->hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+        applyColorLut(*table, image);
+        break;
+    }
+    image->setColorSpace(display);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <QImage>
+#include <QColorSpace>
+#include <QByteArray>
+#include <QSharedPointer>
+
+struct ColorLut;
+
+// Converts images to the colour space of the display when they are decoded,
+// so painting them stays a plain copy. Each pair of colour spaces gets a 3D
+// lookup table, which is built with QColorTransform and then kept in memory
+// and in $XDG_CACHE_HOME/qeh, so it is only built once.
+//
+// The display profile is the _ICC_PROFILE of the X root window, or sRGB.
+// Images without a colour space are assumed to be sRGB.
+class ColorManager
+{
+public:
+    // Looks up the display profile, call it from the GUI thread before
+    // anything that uses it is decoded.
+    static void initialize();
+
+    // Can be called from any thread, does nothing if it isn't initialized or
+    // the image is already in the display colour space.
+    static void convert(QImage *image);
+
+    // Changes with the display profile
+    static QByteArray displayKey();
+
+private:
+    static QColorSpace displayColorSpace();
+    static QSharedPointer<const ColorLut> lut(const QColorSpace &source, const QColorSpace &display);
+    static bool loadLut(const QString &path, ColorLut *lut);
+    static void storeLut(const QString &path, const ColorLut &lut);
+};
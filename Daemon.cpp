@@ -0,0 +1,400 @@
+#include "Daemon.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QDataStream>
+#include <QFile>
+#include <QDir>
+#include <QDebug>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Way more than any list of files
+static const quint32 s_maxRequestSize = 16 * 1024 * 1024;
+
+// How long a client gets to send its request, in ms
+static const int s_requestTimeout = 1000;
+
+// Only talk to processes of the same user
+static bool isOwnPeer(int descriptor)
+{
+    ucred credentials;
+    socklen_t size = sizeof(credentials);
+    if (getsockopt(descriptor, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+        return false;
+    }
+    return credentials.uid == getuid();
+}
+
+// Ours, a real directory, and not accessible to anyone else
+static bool isPrivateDirectory(const QByteArray &path)
+{
+    struct stat info;
+    if (lstat(path.constData(), &info) != 0) {
+        return false;
+    }
+    return S_ISDIR(info.st_mode) && info.st_uid == getuid() && (info.st_mode & 0777) == 0700;
+}
+
+static bool fillAddress(sockaddr_un *address, const QString &path)
+{
+    if (path.isEmpty()) {
+        return false;
+    }
+    const QByteArray encoded = QFile::encodeName(path);
+    memset(address, 0, sizeof(*address));
+    if (encoded.size() >= int(sizeof(address->sun_path))) {
+        qWarning() << "Socket path too long:" << path;
+        return false;
+    }
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, encoded.constData(), encoded.size());
+    return true;
+}
+
+static bool writeAll(int descriptor, const char *data, qint64 size)
+{
+    while (size > 0) {
+        const ssize_t written = send(descriptor, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool readAll(int descriptor, char *data, qint64 size)
+{
+    while (size > 0) {
+        const ssize_t count = recv(descriptor, data, size, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+Daemon::Daemon(const Handler &handler, QObject *parent) :
+    QObject(parent),
+    m_handler(handler)
+{
+}
+
+Daemon::~Daemon()
+{
+    for (const int client : m_pending.keys()) {
+        rejectRequest(client);
+    }
+    if (m_socket >= 0) {
+        close(m_socket);
+        unlink(QFile::encodeName(socketPath()).constData());
+    }
+}
+
+QString Daemon::socketDirectory()
+{
+    // Not in a shared directory like /tmp, someone else could get there first
+    const QString runtimeDirectory = qEnvironmentVariable("XDG_RUNTIME_DIR");
+    if (runtimeDirectory.isEmpty()) {
+        return QString();
+    }
+    return runtimeDirectory + QStringLiteral("/qeh");
+}
+
+QString Daemon::socketPath()
+{
+    const QString directory = socketDirectory();
+    if (directory.isEmpty()) {
+        return QString();
+    }
+
+    // One for each display, so the windows show up where they're expected
+    QString display = qEnvironmentVariable("WAYLAND_DISPLAY", qEnvironmentVariable("DISPLAY"));
+    display.replace(QLatin1Char('/'), QLatin1Char('_'));
+
+    return directory + QStringLiteral("/display") + display + QStringLiteral(".socket");
+}
+
+bool Daemon::listen()
+{
+    const QString directory = socketDirectory();
+    if (directory.isEmpty()) {
+        qWarning() << "XDG_RUNTIME_DIR is not set, can't run as a daemon";
+        return false;
+    }
+    const QByteArray encodedDirectory = QFile::encodeName(directory);
+    if (mkdir(encodedDirectory.constData(), 0700) != 0 && errno != EEXIST) {
+        qWarning() << "Failed to create" << directory << strerror(errno);
+        return false;
+    }
+    if (!isPrivateDirectory(encodedDirectory)) {
+        qWarning() << directory << "is not a private directory owned by us";
+        return false;
+    }
+
+    const QString path = socketPath();
+    sockaddr_un address;
+    if (!fillAddress(&address, path)) {
+        return false;
+    }
+
+    // Check if it is from a daemon that is still running
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+        close(probe);
+        qWarning() << "A daemon is already running on" << path;
+        return false;
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
+    unlink(address.sun_path);
+
+    m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_socket < 0 ||
+            bind(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(m_socket, SOMAXCONN) != 0) {
+        qWarning() << "Failed to listen on" << path << strerror(errno);
+        if (m_socket >= 0) {
+            close(m_socket);
+            m_socket = -1;
+        }
+        return false;
+    }
+    // In case we're not in XDG_RUNTIME_DIR
+    chmod(address.sun_path, S_IRUSR | S_IWUSR);
+
+    m_notifier = new QSocketNotifier(m_socket, QSocketNotifier::Read, this);
+    // The function pointer version is ambiguous because of the overloads
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(onConnection()));
+    return true;
+}
+
+void Daemon::onConnection()
+{
+    const int client = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client < 0) {
+        return;
+    }
+    if (!isOwnPeer(client)) {
+        qWarning() << "Refusing a client of another user";
+        close(client);
+        return;
+    }
+
+    // The request is read as it arrives, so a client that is slow to send
+    // it doesn't block the windows we already have.
+    PendingRequest &request = m_pending[client];
+    request.serial = ++m_lastSerial;
+    request.notifier = new QSocketNotifier(client, QSocketNotifier::Read, this);
+    connect(request.notifier, SIGNAL(activated(int)), this, SLOT(onClientReadable(int)));
+
+    const quint64 serial = request.serial;
+    QTimer::singleShot(s_requestTimeout, this, [this, client, serial]() {
+            // The descriptor might have been reused for a newer client
+            if (m_pending.contains(client) && m_pending.value(client).serial == serial) {
+                qWarning() << "Client took too long to send its request";
+                rejectRequest(client);
+            }
+        });
+}
+
+// Only one descriptor is expected in total, the rest are closed
+static void takeDescriptors(msghdr *message, int *stdinDescriptor)
+{
+    for (cmsghdr *header = CMSG_FIRSTHDR(message); header; header = CMSG_NXTHDR(message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int descriptor = -1;
+            memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(descriptor));
+            if (header->cmsg_len == CMSG_LEN(sizeof(int)) && *stdinDescriptor < 0) {
+                *stdinDescriptor = descriptor;
+            } else {
+                qWarning() << "Ignoring an extra descriptor from client";
+                close(descriptor);
+            }
+        }
+    }
+}
+
+void Daemon::onClientReadable(int client)
+{
+    if (!m_pending.contains(client)) {
+        return;
+    }
+    PendingRequest &request = m_pending[client];
+
+    // The size of the request comes first, with the stdin of the client
+    // attached if it wants us to read that.
+    qint64 wanted = sizeof(quint32);
+    if (request.data.size() >= wanted) {
+        quint32 size = 0;
+        memcpy(&size, request.data.constData(), sizeof(size));
+        wanted += size;
+    }
+    const int offset = request.data.size();
+    request.data.resize(wanted);
+
+    iovec iov = { request.data.data() + offset, size_t(wanted - offset) };
+    // Room for more than we want, so we can close the extra ones (the
+    // kernel closes whatever doesn't fit)
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    const ssize_t received = recvmsg(client, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        request.data.resize(offset);
+        return;
+    }
+
+    if (received >= 0) {
+        takeDescriptors(&message, &request.stdinDescriptor);
+    }
+    if (received <= 0) {
+        qWarning() << "Client went away before sending its request";
+        rejectRequest(client);
+        return;
+    }
+    request.data.resize(offset + received);
+
+    if (request.data.size() < int(sizeof(quint32))) {
+        return;
+    }
+    quint32 size = 0;
+    memcpy(&size, request.data.constData(), sizeof(size));
+    if (size > s_maxRequestSize) {
+        qWarning() << "Invalid request from client";
+        rejectRequest(client);
+        return;
+    }
+    if (request.data.size() < int(sizeof(quint32) + size)) {
+        return;
+    }
+
+    QString workingDirectory;
+    QStringList arguments;
+    QDataStream stream(request.data.mid(sizeof(quint32)));
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream >> workingDirectory >> arguments;
+    if (stream.status() != QDataStream::Ok) {
+        qWarning() << "Invalid request from client";
+        rejectRequest(client);
+        return;
+    }
+
+    const int stdinDescriptor = request.stdinDescriptor;
+    finishRequest(client);
+    m_handler(workingDirectory, arguments, stdinDescriptor, [client](bool opened) {
+            const char result = opened;
+            writeAll(client, &result, sizeof(result));
+            close(client);
+        });
+}
+
+void Daemon::finishRequest(int client)
+{
+    const PendingRequest request = m_pending.take(client);
+    // We might be in its signal, and it mustn't fire again for a reused descriptor
+    request.notifier->setEnabled(false);
+    request.notifier->deleteLater();
+}
+
+void Daemon::rejectRequest(int client)
+{
+    const int stdinDescriptor = m_pending.value(client).stdinDescriptor;
+    if (stdinDescriptor >= 0) {
+        close(stdinDescriptor);
+    }
+    finishRequest(client);
+
+    const char result = 0;
+    writeAll(client, &result, sizeof(result));
+    close(client);
+}
+
+bool Daemon::forward(const QStringList &arguments, int *exitCode)
+{
+    sockaddr_un address;
+    if (!fillAddress(&address, socketPath()) || !isPrivateDirectory(QFile::encodeName(socketDirectory()))) {
+        return false;
+    }
+    const int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection < 0) {
+        return false;
+    }
+    if (::connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        // Not running
+        close(connection);
+        return false;
+    }
+    if (!isOwnPeer(connection)) {
+        // Don't give our arguments or stdin to someone else
+        qWarning() << "The daemon socket belongs to another user, ignoring it";
+        close(connection);
+        return false;
+    }
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << QDir::currentPath() << arguments;
+
+    quint32 size = payload.size();
+    iovec iov = { &size, sizeof(size) };
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (arguments.contains(QStringLiteral("-"))) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        const int stdinDescriptor = STDIN_FILENO;
+        memcpy(CMSG_DATA(header), &stdinDescriptor, sizeof(stdinDescriptor));
+    }
+
+    // Waits until the daemon has loaded it (or failed)
+    char reply = 0;
+    const bool sent = sendmsg(connection, &message, MSG_NOSIGNAL) == sizeof(size) &&
+        writeAll(connection, payload.constData(), payload.size()) &&
+        readAll(connection, &reply, sizeof(reply));
+    close(connection);
+
+    if (!sent) {
+        // Opened here instead
+        qWarning() << "Lost the connection to the daemon";
+        return false;
+    }
+    if (!reply) {
+        qWarning() << "The daemon failed to open" << arguments;
+    }
+    *exitCode = reply ? 0 : 1;
+    return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+
+#include <functional>
+
+class QSocketNotifier;
+
+// Keeps a process with Qt and the image plugins loaded around, so opening an
+// image only needs to hand the arguments over a local socket. If "-" is one
+// of them, the stdin of the client is passed along as well, so the data goes
+// straight to the daemon.
+//
+// The socket is in a private directory in $XDG_RUNTIME_DIR, and both ends
+// check that the other one is the same user.
+class Daemon : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Tells the client whether something was opened, has to be called once
+    typedef std::function<void(bool opened)> Reply;
+
+    // Gets the working directory and arguments of the client, and its stdin
+    // (or -1) which it has to close. It can reply later, so it doesn't have
+    // to wait for the input in the GUI thread.
+    typedef std::function<void(const QString &workingDirectory, const QStringList &arguments, int stdinDescriptor, const Reply &reply)> Handler;
+
+    explicit Daemon(const Handler &handler, QObject *parent = nullptr);
+    ~Daemon();
+
+    // Fails if another daemon is already running
+    bool listen();
+
+    // Client side, doesn't need a QCoreApplication. Returns false if there is
+    // no daemon running or it went away, otherwise exitCode is set.
+    static bool forward(const QStringList &arguments, int *exitCode);
+
+private slots:
+    void onConnection();
+    void onClientReadable(int client);
+
+private:
+    // Empty if there is no private place for it
+    static QString socketDirectory();
+    static QString socketPath();
+
+    // A request that hasn't fully arrived yet
+    struct PendingRequest {
+        QSocketNotifier *notifier = nullptr;
+        QByteArray data;
+        int stdinDescriptor = -1;
+        // Descriptors are reused, this isn't
+        quint64 serial = 0;
+    };
+    void finishRequest(int client);
+    // Tells the client we didn't open anything, and closes it
+    void rejectRequest(int client);
+
+    Handler m_handler;
+    int m_socket = -1;
+    QSocketNotifier *m_notifier = nullptr;
+    QHash<int, PendingRequest> m_pending;
+    quint64 m_lastSerial = 0;
+};
@@ -0,0 +1,298 @@
+#include "DiskCache.h"
+
+#include "ColorManager.h"
+#include "Profiler.h"
+
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QFile>
+#include <QDir>
+#include <QAtomicInt>
+#include <QDebug>
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+// Total, the least recently used are removed when we go over
+static const qint64 s_maxSize = 1024 * 1024 * 1024;
+
+static const char s_magic[4] = { 'Q', 'E', 'H', 'C' };
+static const int s_version = 1;
+static const char s_suffix[] = ".raw";
+
+// Holds the total size of the entries, so storing doesn't list the directory
+static const char s_indexName[] = "/index";
+
+// The pixels start at a multiple of this
+static const qint64 s_pixelAlignment = 64;
+
+namespace {
+// Followed by the reader format, the format, the delays and the pixels of
+// each frame.
+struct Header {
+    char magic[4];
+    qint32 version;
+    qint32 imageWidth;
+    qint32 imageHeight;
+    qint32 width;
+    qint32 height;
+    qint32 bytesPerLine;
+    qint32 format;
+    qint32 frameCount;
+    qint32 animated;
+    qint32 readerFormatSize;
+    qint32 formatSize;
+};
+
+struct Mapping {
+    void *data;
+    size_t size;
+    QAtomicInt frames;
+};
+}
+
+static void releaseMapping(void *info)
+{
+    Mapping *mapping = static_cast<Mapping*>(info);
+    if (!mapping->frames.deref()) {
+        munmap(mapping->data, mapping->size);
+        delete mapping;
+    }
+}
+
+static qint64 pixelOffset(const Header &header)
+{
+    const qint64 end = sizeof(Header) + header.readerFormatSize + header.formatSize + header.frameCount * qint64(sizeof(qint32));
+    return (end + s_pixelAlignment - 1) / s_pixelAlignment * s_pixelAlignment;
+}
+
+QString DiskCache::directory()
+{
+    // Respects XDG_CACHE_HOME
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QStringLiteral("/qeh");
+}
+
+qint64 DiskCache::maxEntrySize()
+{
+    return s_maxSize / 4;
+}
+
+QString DiskCache::key(const QString &fileName, bool colorManaged)
+{
+    const QFileInfo info(fileName);
+    if (!info.isFile()) {
+        return QString();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(info.canonicalFilePath().toUtf8());
+    hash.addData(QByteArray(1, '\0'));
+    hash.addData(QByteArray::number(info.size()));
+    hash.addData(QByteArray(1, '\0'));
+    hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+    if (colorManaged) {
+        // What is stored is already converted to the display profile
+        hash.addData(ColorManager::displayKey());
+    }
+    return QString::fromLatin1(hash.result().toHex()) + QLatin1String(s_suffix);
+}
+
+bool DiskCache::load(const QString &key, CachedImage *image)
+{
+    ProfileScope scope("disk cache load");
+
+    const QByteArray path = QFile::encodeName(directory() + QLatin1Char('/') + key);
+    const int fd = open(path.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < qint64(sizeof(Header))) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // For the eviction, this is now the most recently used
+    futimens(fd, nullptr);
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    const char *data = static_cast<const char*>(mapped);
+
+    Header header;
+    memcpy(&header, data, sizeof(header));
+    bool valid = memcmp(header.magic, s_magic, sizeof(s_magic)) == 0 && header.version == s_version &&
+        header.width > 0 && header.height > 0 && header.frameCount > 0 &&
+        header.readerFormatSize >= 0 && header.readerFormatSize < 256 &&
+        header.formatSize >= 0 && header.formatSize < 256 &&
+        // No color tables
+        header.format >= QImage::Format_RGB32 && header.format < QImage::NImageFormats;
+    if (valid) {
+        const int bitsPerPixel = QImage::toPixelFormat(QImage::Format(header.format)).bitsPerPixel();
+        const qint64 frameSize = qint64(header.bytesPerLine) * header.height;
+        valid = header.bytesPerLine >= (qint64(header.width) * bitsPerPixel + 7) / 8 &&
+            pixelOffset(header) + frameSize * header.frameCount == info.st_size;
+    }
+    if (!valid) {
+        qWarning() << "Invalid disk cache entry" << key;
+        munmap(mapped, info.st_size);
+        QFile::remove(QFile::decodeName(path));
+        return false;
+    }
+
+    const char *strings = data + sizeof(Header);
+    image->imageSize = QSize(header.imageWidth, header.imageHeight);
+    image->readerFormat = QByteArray(strings, header.readerFormatSize);
+    image->format = QString::fromUtf8(strings + header.readerFormatSize, header.formatSize);
+    image->animated = header.animated;
+
+    const char *delays = strings + header.readerFormatSize + header.formatSize;
+    image->delays.resize(header.frameCount);
+    memcpy(image->delays.data(), delays, header.frameCount * sizeof(qint32));
+
+    // Each frame keeps the mapping alive
+    Mapping *mapping = new Mapping;
+    mapping->data = mapped;
+    mapping->size = info.st_size;
+    mapping->frames.storeRelaxed(header.frameCount);
+
+    const uchar *pixels = reinterpret_cast<const uchar*>(data + pixelOffset(header));
+    const qint64 frameSize = qint64(header.bytesPerLine) * header.height;
+    image->frames.clear();
+    for (int i = 0; i < header.frameCount; i++) {
+        image->frames.append(QImage(pixels + i * frameSize, header.width, header.height, header.bytesPerLine,
+                    QImage::Format(header.format), releaseMapping, mapping));
+    }
+    scope.setArg("frames", header.frameCount);
+    return true;
+}
+
+bool DiskCache::store(const QString &key, const CachedImage &image)
+{
+    if (key.isEmpty() || image.frames.isEmpty() || image.delays.count() != image.frames.count()) {
+        return false;
+    }
+    ProfileScope scope("disk cache store");
+
+    const QImage &first = image.frames.first();
+    QImage::Format format = first.format();
+    if (format < QImage::Format_RGB32) {
+        format = first.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    }
+    const int bytesPerLine = first.convertToFormat(format).bytesPerLine();
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.imageWidth = image.imageSize.width();
+    header.imageHeight = image.imageSize.height();
+    header.width = first.width();
+    header.height = first.height();
+    header.bytesPerLine = bytesPerLine;
+    header.format = format;
+    header.frameCount = image.frames.count();
+    header.animated = image.animated;
+
+    const QByteArray formatName = image.format.toUtf8();
+    header.readerFormatSize = image.readerFormat.size();
+    header.formatSize = formatName.size();
+
+    const qint64 frameSize = qint64(bytesPerLine) * header.height;
+    if (pixelOffset(header) + frameSize * header.frameCount > maxEntrySize()) {
+        return false;
+    }
+
+    if (!QDir().mkpath(directory())) {
+        qWarning() << "Failed to create" << directory();
+        return false;
+    }
+    QSaveFile file(directory() + QLatin1Char('/') + key);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write to disk cache" << file.errorString();
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(image.readerFormat);
+    file.write(formatName);
+    for (const int delay : image.delays) {
+        const qint32 value = delay;
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    file.write(QByteArray(pixelOffset(header) - file.pos(), '\0'));
+
+    for (const QImage &frame : image.frames) {
+        const QImage converted = frame.convertToFormat(format);
+        if (converted.size() != first.size() || converted.bytesPerLine() != bytesPerLine) {
+            file.cancelWriting();
+            return false;
+        }
+        file.write(reinterpret_cast<const char*>(converted.constBits()), frameSize);
+    }
+    if (!file.commit()) {
+        qWarning() << "Failed to write to disk cache" << file.errorString();
+        return false;
+    }
+
+    evict(pixelOffset(header) + frameSize * header.frameCount);
+    return true;
+}
+
+void DiskCache::evict(qint64 added)
+{
+    const QByteArray path = QFile::encodeName(directory() + QLatin1String(s_indexName));
+    const int fd = open(path.constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        removeOldest();
+        return;
+    }
+    // Other windows and the daemon store into the same directory
+    flock(fd, LOCK_EX);
+
+    // Replaced and invalid entries are still counted, but that only makes us
+    // list the directory a bit sooner, which corrects the total.
+    qint64 total = -1;
+    if (pread(fd, &total, sizeof(total), 0) == sizeof(total) && total >= 0) {
+        total += added;
+    } else {
+        total = -1;
+    }
+    if (total < 0 || total > s_maxSize) {
+        total = removeOldest();
+    }
+    if (pwrite(fd, &total, sizeof(total), 0) != sizeof(total)) {
+        qWarning() << "Failed to update the disk cache index";
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+qint64 DiskCache::removeOldest()
+{
+    ProfileScope scope("disk cache evict");
+
+    // Newest first, so keep them until we reach the limit
+    const QFileInfoList entries = QDir(directory()).entryInfoList(
+            { QStringLiteral("*") + QLatin1String(s_suffix) }, QDir::Files, QDir::Time);
+    qint64 total = 0;
+    qint64 kept = 0;
+    for (const QFileInfo &entry : entries) {
+        total += entry.size();
+        if (total > s_maxSize) {
+            QFile::remove(entry.filePath());
+        } else {
+            kept = total;
+        }
+    }
+    return kept;
+}
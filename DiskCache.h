@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QImage>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+
+// What we need to show an image without probing or decoding it.
+struct CachedImage {
+    // Of the original, the frames are usually smaller
+    QSize imageSize;
+    QByteArray readerFormat;
+    QString format; // for showing, includes the subtype
+    bool animated = false;
+
+    // All the same size and pixel format
+    QVector<QImage> frames;
+    QVector<int> delays;
+};
+
+// Screen sized decodes of images, and scaled frames of animations, stored
+// in $XDG_CACHE_HOME/qeh so opening the same file again skips the decoding.
+// Entries are the raw pixels behind a small header, and are memory mapped
+// when loaded. They are keyed on the path, size and modification time of the
+// file, and the least recently used are removed when over s_maxSize.
+class DiskCache
+{
+public:
+    // Empty if the file can't be cached (e.g. stdin). Images converted to
+    // the display profile are stored separately.
+    static QString key(const QString &fileName, bool colorManaged);
+
+    // The frames point into the mapping, which stays until they are gone
+    static bool load(const QString &key, CachedImage *image);
+
+    // Can be called from any thread
+    static bool store(const QString &key, const CachedImage &image);
+
+    // Bigger entries are not stored
+    static qint64 maxEntrySize();
+
+private:
+    static QString directory();
+    // Only lists the directory when the total in the index goes over s_maxSize
+    static void evict(qint64 added);
+    // Returns the size of what is left
+    static qint64 removeOldest();
+};
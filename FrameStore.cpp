@@ -0,0 +1,162 @@
+#include "FrameStore.h"
+
+#include <algorithm>
+
+// Compressed, so this is quite a lot of frames
+static const qint64 s_maxStoreBytes = 256 * 1024 * 1024;
+
+// Shorter runs are stored as literals
+static const int s_minimumRun = 3;
+
+// Each chunk starts with a header word with the count, if the top bit is
+// set the next word is repeated count times, otherwise count words follow.
+static const quint32 s_runFlag = 0x80000000;
+
+static inline quint32 wordAt(const quint32 *pixels, const quint32 *previous, int i)
+{
+    return previous ? pixels[i] ^ previous[i] : pixels[i];
+}
+
+static void encode(const quint32 *pixels, const quint32 *previous, int count, QVector<quint32> *out)
+{
+    int i = 0;
+    while (i < count) {
+        const quint32 value = wordAt(pixels, previous, i);
+        int run = 1;
+        while (i + run < count && wordAt(pixels, previous, i + run) == value) {
+            run++;
+        }
+        if (run >= s_minimumRun) {
+            out->append(s_runFlag | quint32(run));
+            out->append(value);
+            i += run;
+            continue;
+        }
+
+        // Literals until the next run starts
+        const int start = i;
+        i += run;
+        while (i < count) {
+            const quint32 next = wordAt(pixels, previous, i);
+            if (i + 2 < count && wordAt(pixels, previous, i + 1) == next && wordAt(pixels, previous, i + 2) == next) {
+                break;
+            }
+            i++;
+        }
+        out->append(quint32(i - start));
+        for (int j = start; j < i; j++) {
+            out->append(wordAt(pixels, previous, j));
+        }
+    }
+}
+
+// If delta is set the pixels contain the previous frame, and are xor'ed
+static void decode(const QVector<quint32> &data, quint32 *pixels, bool delta)
+{
+    const quint32 *in = data.constData();
+    const quint32 *end = in + data.count();
+    while (in < end) {
+        const quint32 header = *in++;
+        const int count = header & ~s_runFlag;
+        if (header & s_runFlag) {
+            const quint32 value = *in++;
+            if (!delta) {
+                std::fill(pixels, pixels + count, value);
+            } else if (value) {
+                for (int i = 0; i < count; i++) {
+                    pixels[i] ^= value;
+                }
+            }
+        } else if (!delta) {
+            std::copy(in, in + count, pixels);
+            in += count;
+        } else {
+            for (int i = 0; i < count; i++) {
+                pixels[i] ^= *in++;
+            }
+        }
+        pixels += count;
+    }
+}
+
+FrameStore::FrameStore()
+{
+}
+
+bool FrameStore::append(const QImage &image, int delay)
+{
+    if (!m_enabled) {
+        return false;
+    }
+    if (m_frames.isEmpty()) {
+        m_size = image.size();
+        m_format = image.depth() == 32 ? image.format() : (image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
+    if (image.size() != m_size || image.isNull()) {
+        disable();
+        return false;
+    }
+
+    // 32 bit lines are always tightly packed
+    const QImage converted = image.format() == m_format ? image : image.convertToFormat(m_format);
+    const quint32 *pixels = reinterpret_cast<const quint32*>(converted.constBits());
+    const quint32 *previous = nullptr;
+    if (m_frames.count() % s_keyframeInterval != 0) {
+        previous = reinterpret_cast<const quint32*>(m_previous.constBits());
+    }
+
+    Entry entry;
+    entry.delay = delay;
+    encode(pixels, previous, m_size.width() * m_size.height(), &entry.data);
+    entry.data.squeeze();
+
+    m_bytes += entry.data.count() * sizeof(quint32);
+    if (m_bytes > s_maxStoreBytes) {
+        disable();
+        return false;
+    }
+    m_frames.append(entry);
+    m_previous = converted;
+    return true;
+}
+
+QImage FrameStore::frame(int number, int *delay)
+{
+    if (number < 0 || number >= m_frames.count()) {
+        return QImage();
+    }
+
+    if (number == m_lastNumber) {
+        *delay = m_frames[number].delay;
+        return m_last;
+    }
+
+    // Go back to the closest keyframe if we can't continue from the last one
+    int first = number - number % s_keyframeInterval;
+    if (m_lastNumber >= first && m_lastNumber < number) {
+        first = m_lastNumber + 1;
+    } else {
+        m_last = QImage(m_size, m_format);
+    }
+
+    for (int i = first; i <= number; i++) {
+        // Detaches from the frame we handed out last
+        quint32 *pixels = reinterpret_cast<quint32*>(m_last.bits());
+        decode(m_frames[i].data, pixels, i % s_keyframeInterval != 0);
+    }
+    m_lastNumber = number;
+
+    *delay = m_frames[number].delay;
+    return m_last;
+}
+
+void FrameStore::disable()
+{
+    m_enabled = false;
+    m_complete = false;
+    m_frames.clear();
+    m_bytes = 0;
+    m_previous = QImage();
+    m_last = QImage();
+    m_lastNumber = -1;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <QImage>
+#include <QVector>
+
+// Keeps all the frames of an animation in memory, compressed so long
+// animations can loop without decoding them again. Each frame is stored as
+// the difference to the previous one (except every s_keyframeInterval'th),
+// run length encoded, so unchanged areas cost almost nothing.
+//
+// Frames have to be appended in order, starting from 0. Not thread safe.
+class FrameStore
+{
+public:
+    FrameStore();
+
+    // Returns false if the frame can't be stored (different size, or over
+    // budget), then the store disables itself and drops everything.
+    bool append(const QImage &image, int delay);
+    void setComplete() { m_complete = m_enabled && !m_frames.isEmpty(); }
+
+    bool isEnabled() const { return m_enabled; }
+    bool isComplete() const { return m_complete; }
+    int count() const { return m_frames.count(); }
+    qint64 sizeInBytes() const { return m_bytes; }
+
+    // Fastest when called for consecutive frames
+    QImage frame(int number, int *delay);
+
+private:
+    void disable();
+
+    struct Entry {
+        QVector<quint32> data;
+        int delay = 0;
+    };
+
+    static const int s_keyframeInterval = 32;
+
+    QVector<Entry> m_frames;
+    qint64 m_bytes = 0;
+    bool m_enabled = true;
+    bool m_complete = false;
+
+    QSize m_size;
+    QImage::Format m_format = QImage::Format_Invalid;
+
+    // Last appended, to diff against
+    QImage m_previous;
+
+    // Last returned, to apply the next diff to
+    QImage m_last;
+    int m_lastNumber = -1;
+};
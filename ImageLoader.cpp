@@ -0,0 +1,87 @@
+#include "ImageLoader.h"
+
+#include "mipmaps.h"
+#include "ColorManager.h"
+#include "InterruptibleDevice.h"
+#include "Profiler.h"
+#include "StreamBuffer.h"
+
+#include <QImageReader>
+#include <QElapsedTimer>
+#include <QDebug>
+
+ImageLoader::ImageLoader(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, QObject *parent) :
+    QThread(parent),
+    m_stream(stream),
+    m_format(format)
+{
+    qRegisterMetaType<QVector<QImage>>("QVector<QImage>");
+}
+
+ImageLoader::~ImageLoader()
+{
+    requestInterruption();
+    wait();
+}
+
+bool ImageLoader::decode(QImage *image, const QSize &scaledSize, QString *error)
+{
+    ProfileScope scope(scaledSize.isValid() ? "decode preview" : "decode");
+    StreamDevice file(m_stream);
+    file.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    InterruptibleDevice device(&file, this);
+    device.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+
+    QImageReader reader(&device, m_format);
+    if (scaledSize.isValid()) {
+        reader.setScaledSize(scaledSize);
+    }
+    if (!reader.read(image)) {
+        *error = reader.errorString();
+        return false;
+    }
+    if (m_colorManaged) {
+        ColorManager::convert(image);
+    }
+    return true;
+}
+
+void ImageLoader::run()
+{
+    QImage image;
+    QString error;
+
+    if (m_previewSize.isValid()) {
+        if (!decode(&image, m_previewSize, &error)) {
+            if (!isInterruptionRequested()) {
+                emit loadFailed(error);
+            }
+            return;
+        }
+        emit previewLoaded(image);
+    }
+    if (isInterruptionRequested()) {
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!decode(&image, QSize(), &error)) {
+        if (!isInterruptionRequested()) {
+            emit loadFailed(error);
+        }
+        return;
+    }
+    if (isInterruptionRequested()) {
+        return;
+    }
+    emit decoded(timer.nsecsElapsed() / 1000);
+    emit imageLoaded(image);
+
+    ProfileScope mipmapScope("mipmaps");
+    const QVector<QImage> levels = buildMipmaps(image);
+    if (isInterruptionRequested()) {
+        return;
+    }
+    emit mipmapsLoaded(levels);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QThread>
+#include <QImage>
+#include <QByteArray>
+#include <QString>
+#include <QSize>
+#include <QVector>
+#include <QSharedPointer>
+
+class StreamBuffer;
+
+// Decodes static images outside the GUI thread. If a preview size is set it
+// first decodes a screen sized preview, then the full resolution image, and
+// finally the mipmaps of it for scaling.
+class ImageLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    ImageLoader(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, QObject *parent = nullptr);
+    ~ImageLoader();
+
+    void setPreviewSize(const QSize &size) { m_previewSize = size; }
+    // Converts to the display profile, ColorManager needs to be initialized
+    void setColorManaged(bool colorManaged) { m_colorManaged = colorManaged; }
+
+signals:
+    void previewLoaded(const QImage &image);
+    // Microseconds spent on the full resolution, sent before imageLoaded
+    void decoded(qint64 decodeTime);
+    void imageLoaded(const QImage &image);
+    void mipmapsLoaded(const QVector<QImage> &levels);
+    void loadFailed(const QString &error);
+
+protected:
+    void run() override;
+
+private:
+    bool decode(QImage *image, const QSize &scaledSize, QString *error);
+
+    const QSharedPointer<StreamBuffer> m_stream;
+    const QByteArray m_format;
+    QSize m_previewSize;
+    bool m_colorManaged = false;
+};
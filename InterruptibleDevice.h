@@ -0,0 +1,42 @@
+#pragma once
+
+#include <QIODevice>
+#include <QThread>
+
+// Makes the image decoders bail out when we get interrupted, so we don't
+// have to wait for a slow plugin to finish before we can quit.
+class InterruptibleDevice : public QIODevice
+{
+public:
+    InterruptibleDevice(QIODevice *device, const QThread *thread) :
+        m_device(device),
+        m_thread(thread)
+    {
+    }
+
+    bool isSequential() const override { return m_device->isSequential(); }
+    qint64 size() const override { return m_device->size(); }
+    bool atEnd() const override { return m_device->atEnd(); }
+    qint64 bytesAvailable() const override { return m_device->bytesAvailable(); }
+
+    bool seek(qint64 pos) override {
+        return QIODevice::seek(pos) && m_device->seek(pos);
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override {
+        if (m_thread->isInterruptionRequested()) {
+            setErrorString("Interrupted");
+            return -1;
+        }
+        return m_device->read(data, maxSize);
+    }
+
+    qint64 writeData(const char *, qint64) override {
+        return -1;
+    }
+
+private:
+    QIODevice *m_device;
+    const QThread *m_thread;
+};
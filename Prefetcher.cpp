@@ -0,0 +1,117 @@
+#include "Prefetcher.h"
+
+#include "StreamBuffer.h"
+#include "ColorManager.h"
+#include "InterruptibleDevice.h"
+#include "formats.h"
+#include "mipmaps.h"
+#include "Profiler.h"
+#include "TileLoader.h"
+#include "Viewer.h"
+
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QDebug>
+
+int DecodedImage::cost() const
+{
+    qint64 bytes = image.sizeInBytes() + scaled.sizeInBytes();
+    // The first level is the image itself
+    for (int i = 1; i < mipmaps.count(); i++) {
+        bytes += mipmaps[i].sizeInBytes();
+    }
+    return int(bytes / 1024);
+}
+
+Prefetcher::Prefetcher(QObject *parent) :
+    QThread(parent)
+{
+    qRegisterMetaType<DecodedImage>("DecodedImage");
+}
+
+Prefetcher::~Prefetcher()
+{
+    requestInterruption();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_wakeup.wakeAll();
+    }
+    wait();
+}
+
+void Prefetcher::prefetch(const QStringList &fileNames, const QSize &screenSize)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue = fileNames;
+    m_screenSize = screenSize;
+    m_wakeup.wakeAll();
+}
+
+bool Prefetcher::decode(const QString &fileName, const QSize &screenSize, bool colorManaged, DecodedImage *decoded)
+{
+    ProfileScope scope("prefetch");
+
+    QString error;
+    const QSharedPointer<StreamBuffer> stream = StreamBuffer::fromFile(fileName, &error);
+    if (!stream) {
+        qWarning() << "Failed to open" << fileName << error;
+        return false;
+    }
+    StreamDevice file(stream);
+    file.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    InterruptibleDevice device(&file, QThread::currentThread());
+    device.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+
+    const QByteArray sniffedFormat = sniffFormat(stream->header(s_sniffSize));
+    QImageReader reader(&device, sniffedFormat);
+    if (!reader.canRead() && !sniffedFormat.isEmpty()) {
+        device.seek(0);
+        reader.setFormat(QByteArray());
+        reader.setDevice(&device);
+    }
+    if (reader.supportsAnimation() || TileLoader::shouldTile(&reader)) {
+        return false;
+    }
+    decoded->readerFormat = reader.format();
+    decoded->format = QString::fromLatin1(reader.format());
+    if (!reader.subType().isEmpty()) {
+        decoded->format += "/" + reader.subType();
+    }
+
+    if (!reader.read(&decoded->image)) {
+        return false;
+    }
+    if (colorManaged) {
+        ColorManager::convert(&decoded->image);
+    }
+    decoded->mipmaps = buildMipmaps(decoded->image);
+
+    // The same size Viewer scales it to, so it doesn't have to do it again
+    const QSize size = Viewer::openedSize(decoded->image.size(), screenSize);
+    decoded->scaled = bestMipmap(decoded->mipmaps, size).scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    return true;
+}
+
+void Prefetcher::run()
+{
+    while (!isInterruptionRequested()) {
+        QString fileName;
+        QSize screenSize;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !isInterruptionRequested()) {
+                m_wakeup.wait(&m_mutex);
+            }
+            if (isInterruptionRequested()) {
+                return;
+            }
+            fileName = m_queue.takeFirst();
+            screenSize = m_screenSize;
+        }
+
+        DecodedImage decoded;
+        if (decode(fileName, screenSize, m_colorManaged, &decoded) && !isInterruptionRequested()) {
+            emit prefetched(fileName, decoded);
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QThread>
+#include <QImage>
+#include <QVector>
+#include <QStringList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QMetaType>
+
+// A fully decoded static image, with everything we need to show it
+// immediately.
+struct DecodedImage {
+    QImage image;
+    QVector<QImage> mipmaps;
+
+    // Fit to the window, without any effects
+    QImage scaled;
+
+    QByteArray readerFormat;
+    QString format; // for showing, includes the subtype
+
+    // In kB, for the cache
+    int cost() const;
+};
+Q_DECLARE_METATYPE(DecodedImage)
+
+// Decodes the images around the current one while the user is looking at
+// it, so moving to the next or previous one is instant. Animations are
+// skipped, they start playing immediately anyways, and so are images that
+// are too big to decode at once.
+class Prefetcher : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit Prefetcher(QObject *parent = nullptr);
+    ~Prefetcher();
+
+    // Replaces whatever hasn't been decoded yet, in order of priority. The
+    // images are scaled to what Viewer shows them at on this screen size.
+    void prefetch(const QStringList &fileNames, const QSize &screenSize);
+
+    // Call before starting, ColorManager needs to be initialized
+    void setColorManaged(bool colorManaged) { m_colorManaged = colorManaged; }
+
+    // Decodes on the calling thread, returns false if it fails, or it is an
+    // animation or needs tiling.
+    static bool decode(const QString &fileName, const QSize &screenSize, bool colorManaged, DecodedImage *decoded);
+
+signals:
+    void prefetched(const QString &fileName, const DecodedImage &decoded);
+
+protected:
+    void run() override;
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    QStringList m_queue;
+    QSize m_screenSize;
+    bool m_colorManaged = false;
+};
@@ -0,0 +1,60 @@
+#include "Prober.h"
+
+#include "formats.h"
+#include "StreamBuffer.h"
+#include "TileLoader.h"
+#include "Profiler.h"
+
+Prober::Prober(const QSharedPointer<StreamBuffer> &stream, QObject *parent) :
+    QThread(parent),
+    m_stream(stream)
+{
+}
+
+Prober::~Prober()
+{
+    // The stream notices and stops waiting for the data
+    requestInterruption();
+    wait();
+}
+
+ProbeResult Prober::probe(const QSharedPointer<StreamBuffer> &stream)
+{
+    ProfileScope probeScope("probe");
+    ProbeResult result;
+    StreamDevice device(stream);
+    device.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+
+    // Asking all the plugins to look at the data is slow, so first try the
+    // format the magic bytes tell us. The decoders get the same format.
+    result.sniffedFormat = sniffFormat(stream->header(s_sniffSize));
+    QImageReader reader(&device, result.sniffedFormat);
+
+    result.canRead = reader.canRead();
+    if (!result.canRead && !result.sniffedFormat.isEmpty()) {
+        device.seek(0);
+        reader.setFormat(QByteArray());
+        reader.setDevice(&device);
+        result.canRead = reader.canRead();
+    }
+    if (!result.canRead) {
+        result.error = reader.error();
+        result.errorString = reader.errorString();
+    }
+    result.readerFormat = reader.format();
+    result.format = QString::fromLatin1(result.readerFormat);
+    if (!reader.subType().isEmpty()) {
+        result.format += "/" + reader.subType();
+    }
+    probeScope.setArg("format", result.format);
+    result.size = reader.size();
+    result.animated = reader.supportsAnimation();
+    result.supportsScaledSize = reader.supportsOption(QImageIOHandler::ScaledSize);
+    result.shouldTile = TileLoader::shouldTile(&reader);
+    return result;
+}
+
+void Prober::run()
+{
+    m_result = probe(m_stream);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QThread>
+#include <QImageReader>
+#include <QByteArray>
+#include <QString>
+#include <QSize>
+#include <QSharedPointer>
+
+class StreamBuffer;
+
+// What the header of an image tells us
+struct ProbeResult {
+    bool canRead = false;
+    QImageReader::ImageReaderError error = QImageReader::UnknownError;
+    QString errorString;
+
+    QByteArray sniffedFormat;
+    QByteArray readerFormat;
+    QString format; // for showing, includes the subtype
+    QSize size;
+
+    bool animated = false;
+    bool supportsScaledSize = false;
+    bool shouldTile = false;
+};
+
+// Probes the image outside the GUI thread, so input that arrives slowly
+// (e.g. a pipe to the daemon) doesn't block every other window.
+class Prober : public QThread
+{
+public:
+    explicit Prober(const QSharedPointer<StreamBuffer> &stream, QObject *parent = nullptr);
+    ~Prober();
+
+    // Blocks until enough of the input has arrived
+    static ProbeResult probe(const QSharedPointer<StreamBuffer> &stream);
+
+    // Only valid after finished()
+    const ProbeResult &result() const { return m_result; }
+
+protected:
+    void run() override;
+
+private:
+    const QSharedPointer<StreamBuffer> m_stream;
+    ProbeResult m_result;
+};
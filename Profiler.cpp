@@ -0,0 +1,118 @@
+#include "Profiler.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QVector>
+#include <QHash>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QDebug>
+
+bool Profiler::s_enabled = false;
+
+namespace {
+struct Event {
+    const char *name;
+    qint64 start;
+    qint64 duration;
+    int thread;
+    QVariantMap args;
+};
+
+struct ProfilerData {
+    QElapsedTimer timer;
+    QString fileName;
+    QThread *mainThread = nullptr;
+
+    QMutex mutex;
+    QVector<Event> events;
+    QHash<QThread*, int> threadIds;
+    QStringList threadNames;
+};
+}
+
+Q_GLOBAL_STATIC(ProfilerData, s_data)
+
+void Profiler::start(const QString &fileName)
+{
+    s_data->fileName = fileName;
+    s_data->mainThread = QThread::currentThread();
+    s_data->timer.start();
+    s_enabled = true;
+    qAddPostRoutine(&Profiler::write);
+}
+
+qint64 Profiler::now()
+{
+    return s_data->timer.nsecsElapsed() / 1000;
+}
+
+void Profiler::addSpan(const char *name, qint64 start, const QVariantMap &args)
+{
+    if (!s_enabled) {
+        return;
+    }
+    Event event;
+    event.name = name;
+    event.start = start;
+    event.duration = now() - start;
+    event.args = args;
+
+    QThread *thread = QThread::currentThread();
+
+    QMutexLocker locker(&s_data->mutex);
+    if (!s_data->threadIds.contains(thread)) {
+        QString threadName = thread->objectName();
+        if (thread == s_data->mainThread) {
+            threadName = QStringLiteral("main");
+        } else if (threadName.isEmpty()) {
+            threadName = QString::fromLatin1(thread->metaObject()->className());
+        }
+        s_data->threadIds.insert(thread, s_data->threadNames.count());
+        s_data->threadNames.append(threadName);
+    }
+    event.thread = s_data->threadIds.value(thread);
+    s_data->events.append(event);
+}
+
+void Profiler::write()
+{
+    QMutexLocker locker(&s_data->mutex);
+    const qint64 pid = QCoreApplication::applicationPid();
+
+    QJsonArray events;
+    for (int i = 0; i < s_data->threadNames.count(); i++) {
+        QJsonObject metadata;
+        metadata["name"] = "thread_name";
+        metadata["ph"] = "M";
+        metadata["pid"] = pid;
+        metadata["tid"] = i;
+        metadata["args"] = QJsonObject{{"name", s_data->threadNames[i]}};
+        events.append(metadata);
+    }
+    for (const Event &event : s_data->events) {
+        QJsonObject object;
+        object["name"] = QString::fromLatin1(event.name);
+        object["ph"] = "X";
+        object["ts"] = event.start;
+        object["dur"] = event.duration;
+        object["pid"] = pid;
+        object["tid"] = event.thread;
+        if (!event.args.isEmpty()) {
+            object["args"] = QJsonObject::fromVariantMap(event.args);
+        }
+        events.append(object);
+    }
+
+    QFile file(s_data->fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write profile to" << s_data->fileName << file.errorString();
+        return;
+    }
+    file.write(QJsonDocument(QJsonObject{{"traceEvents", events}}).toJson(QJsonDocument::Compact));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <QString>
+#include <QVariantMap>
+
+// Records spans in the Chrome trace event format, so they can be viewed in
+// Perfetto or chrome://tracing. Does nothing unless start() has been called,
+// which has to happen before any other threads are started.
+class Profiler
+{
+public:
+    // The trace is written to fileName when the application exits
+    static void start(const QString &fileName);
+    static bool isEnabled() { return s_enabled; }
+
+    // Microseconds since start()
+    static qint64 now();
+
+    // Ends now
+    static void addSpan(const char *name, qint64 start, const QVariantMap &args = QVariantMap());
+
+private:
+    static void write();
+
+    static bool s_enabled;
+};
+
+// Records a span from construction until it goes out of scope.
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char *name) :
+        m_name(name),
+        m_start(Profiler::isEnabled() ? Profiler::now() : -1)
+    {
+    }
+
+    ~ProfileScope() {
+        if (m_start >= 0) {
+            Profiler::addSpan(m_name, m_start, m_args);
+        }
+    }
+
+    void setArg(const QString &key, const QVariant &value) {
+        if (m_start >= 0) {
+            m_args.insert(key, value);
+        }
+    }
+
+private:
+    const char *m_name;
+    const qint64 m_start;
+    QVariantMap m_args;
+};
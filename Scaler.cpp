@@ -0,0 +1,94 @@
+#include "Scaler.h"
+
+#include "imgeffects.h"
+#include "Profiler.h"
+
+#include <QMutexLocker>
+#include <QElapsedTimer>
+
+#ifdef DEBUG_LOAD_TIME
+#include <QDebug>
+#endif//DEBUG_LOAD_TIME
+
+static void applyEffect(QImage &image, const Viewer::Effect effect)
+{
+    if (effect == Viewer::Equalize) {
+        ProfileScope scope("equalize");
+        equalize(image);
+    } else if (effect == Viewer::Normalize) {
+        ProfileScope scope("normalize");
+        normalize(image);
+    }
+}
+
+Scaler::Scaler(QObject *parent) :
+    QThread(parent)
+{
+}
+
+Scaler::~Scaler()
+{
+    requestInterruption();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_wakeup.wakeAll();
+    }
+    wait();
+}
+
+void Scaler::scale(const Request &request)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pending = request;
+    m_hasPending = true;
+    m_wakeup.wakeAll();
+}
+
+void Scaler::run()
+{
+    while (!isInterruptionRequested()) {
+        Request request;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (!m_hasPending && !isInterruptionRequested()) {
+                m_wakeup.wait(&m_mutex);
+            }
+            if (isInterruptionRequested()) {
+                return;
+            }
+            request = m_pending;
+            m_pending = Request();
+            m_hasPending = false;
+        }
+
+#ifdef DEBUG_LOAD_TIME
+        QElapsedTimer t; t.start();
+#endif
+        ProfileScope scope("scale");
+        scope.setArg("width", request.size.width());
+        scope.setArg("height", request.size.height());
+
+        QElapsedTimer timer;
+        timer.start();
+        qint64 effectTime = 0;
+        qint64 scaleTime = 0;
+
+        QImage image = request.source;
+        if (request.effectFirst) {
+            applyEffect(image, request.effect);
+            effectTime = timer.nsecsElapsed();
+        }
+        image = image.scaled(request.size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        scaleTime = timer.nsecsElapsed() - effectTime;
+        if (!request.effectFirst) {
+            applyEffect(image, request.effect);
+            effectTime = timer.nsecsElapsed() - scaleTime;
+        }
+#ifdef DEBUG_LOAD_TIME
+        qDebug() << "Effect applied in" << t.elapsed() << "ms";
+#endif
+
+        emit timings(scaleTime / 1000, effectTime / 1000);
+        emit scaled(image, request.generation);
+    }
+}
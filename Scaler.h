@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Viewer.h"
+
+#include <QThread>
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+
+// Does the smooth scaling (and effects) outside the GUI thread. Only the
+// latest request is kept, if it gets a new one while busy the older ones
+// are dropped.
+class Scaler : public QThread
+{
+    Q_OBJECT
+
+public:
+    struct Request {
+        QImage source;
+        QSize size;
+        Viewer::Effect effect = Viewer::None;
+        bool effectFirst = false;
+        int generation = 0;
+    };
+
+    explicit Scaler(QObject *parent = nullptr);
+    ~Scaler();
+
+    void scale(const Request &request);
+
+signals:
+    void scaled(const QImage &image, int generation);
+    // In microseconds, sent before scaled()
+    void timings(qint64 scaleTime, qint64 effectTime);
+
+protected:
+    void run() override;
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    Request m_pending;
+    bool m_hasPending = false;
+};
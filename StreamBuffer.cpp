@@ -0,0 +1,216 @@
+#include "StreamBuffer.h"
+
+#include <QMutexLocker>
+#include <QFile>
+#include <QDebug>
+
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+// How often blocked readers check if they should give up
+static const int s_interruptCheckInterval = 50;
+
+static const int s_readChunkSize = 64 * 1024;
+
+// Our own mapping grows at least this much at a time
+static const qint64 s_minimumReserve = 1024 * 1024;
+
+StreamBuffer::StreamBuffer()
+{
+}
+
+StreamBuffer::~StreamBuffer()
+{
+    // The file unmaps itself
+    if (!m_file && m_data) {
+        munmap(m_data, m_mappedSize);
+    }
+    if (m_memfd >= 0) {
+        close(m_memfd);
+    }
+}
+
+QSharedPointer<StreamBuffer> StreamBuffer::fromFile(const QString &fileName, QString *error)
+{
+    QSharedPointer<StreamBuffer> stream(new StreamBuffer);
+    stream->m_file.reset(new QFile(fileName));
+    if (!stream->m_file->open(QIODevice::ReadOnly)) {
+        *error = stream->m_file->errorString();
+        return QSharedPointer<StreamBuffer>();
+    }
+
+    const qint64 size = stream->m_file->size();
+    uchar *mapped = size > 0 ? stream->m_file->map(0, size) : nullptr;
+    if (mapped) {
+        stream->m_data = reinterpret_cast<char*>(mapped);
+        stream->m_size = size;
+    } else {
+        // Not mappable (e.g. a fifo), so read it into our own
+        QScopedPointer<QFile> file(stream->m_file.take());
+        const QByteArray data = file->readAll();
+        stream->append(data.constData(), data.size());
+    }
+    stream->m_finished = true;
+    return stream;
+}
+
+bool StreamBuffer::reserve(qint64 size)
+{
+    if (size <= m_mappedSize) {
+        return true;
+    }
+    const qint64 pageSize = sysconf(_SC_PAGESIZE);
+    qint64 newSize = qMax(qMax(size, m_mappedSize * 2), s_minimumReserve);
+    newSize = (newSize + pageSize - 1) / pageSize * pageSize;
+
+    if (!m_data) {
+        m_memfd = memfd_create("qeh", MFD_CLOEXEC);
+    }
+    if (m_memfd >= 0 && ftruncate(m_memfd, newSize) != 0) {
+        qWarning() << "Failed to resize memfd" << strerror(errno);
+        return false;
+    }
+
+    // The pages are moved, not copied, when growing
+    void *mapped = MAP_FAILED;
+    if (m_data) {
+        mapped = mremap(m_data, m_mappedSize, newSize, MREMAP_MAYMOVE);
+    } else if (m_memfd >= 0) {
+        mapped = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+    } else {
+        mapped = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mapped == MAP_FAILED) {
+        qWarning() << "Failed to map buffer" << strerror(errno);
+        return false;
+    }
+    m_data = static_cast<char*>(mapped);
+    m_mappedSize = newSize;
+    return true;
+}
+
+void StreamBuffer::append(const char *data, qint64 size)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(!m_file);
+    if (!reserve(m_size + size)) {
+        m_finished = true;
+        m_wakeup.wakeAll();
+        return;
+    }
+    memcpy(m_data + m_size, data, size);
+    m_size += size;
+    m_wakeup.wakeAll();
+}
+
+void StreamBuffer::finish()
+{
+    QMutexLocker locker(&m_mutex);
+    m_finished = true;
+    m_wakeup.wakeAll();
+}
+
+void StreamBuffer::abort()
+{
+    QMutexLocker locker(&m_mutex);
+    m_aborted = true;
+    m_wakeup.wakeAll();
+}
+
+bool StreamBuffer::isFinished() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_finished;
+}
+
+qint64 StreamBuffer::size() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_size;
+}
+
+bool StreamBuffer::waitForData(qint64 pos) const
+{
+    QMutexLocker locker(&m_mutex);
+    while (pos >= m_size && !m_finished && !m_aborted) {
+        if (QThread::currentThread()->isInterruptionRequested()) {
+            return false;
+        }
+        m_wakeup.wait(&m_mutex, s_interruptCheckInterval);
+    }
+    return pos < m_size;
+}
+
+QByteArray StreamBuffer::header(qint64 size) const
+{
+    // Wait for the last byte, so we don't just get the first chunk
+    waitForData(size - 1);
+
+    QMutexLocker locker(&m_mutex);
+    return QByteArray(m_data, qMin(size, m_size));
+}
+
+qint64 StreamBuffer::read(qint64 pos, char *data, qint64 maxSize) const
+{
+    if (!waitForData(pos)) {
+        QMutexLocker locker(&m_mutex);
+        return m_aborted || QThread::currentThread()->isInterruptionRequested() ? -1 : 0;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    const qint64 size = qMin(maxSize, m_size - pos);
+    memcpy(data, m_data + pos, size);
+    return size;
+}
+
+StdinReader::StdinReader(int descriptor, QObject *parent) :
+    QThread(parent),
+    m_stream(new StreamBuffer),
+    m_descriptor(descriptor)
+{
+}
+
+StdinReader::~StdinReader()
+{
+    requestInterruption();
+    wait();
+    if (m_descriptor != STDIN_FILENO) {
+        close(m_descriptor);
+    }
+}
+
+void StdinReader::run()
+{
+    QByteArray chunk(s_readChunkSize, Qt::Uninitialized);
+    while (!isInterruptionRequested()) {
+        // Poll so we can quit even if nothing arrives
+        pollfd pfd = {};
+        pfd.fd = m_descriptor;
+        pfd.events = POLLIN;
+        const int ret = poll(&pfd, 1, s_interruptCheckInterval);
+        if (ret < 0 && errno != EINTR) {
+            qWarning() << "Failed to wait for stdin" << strerror(errno);
+            break;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+
+        const ssize_t count = ::read(m_descriptor, chunk.data(), chunk.size());
+        if (count < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            qWarning() << "Failed to read from stdin" << strerror(errno);
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+        m_stream->append(chunk.constData(), count);
+    }
+    m_stream->finish();
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <QIODevice>
+#include <QThread>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSharedPointer>
+#include <QScopedPointer>
+
+class QFile;
+
+// The input data, shared read-only by the probing, decoding and animation
+// threads. Files are memory mapped, data that is still arriving (e.g. from
+// a slow pipe) is kept in a growing memfd mapping so the decoders can seek
+// back and restart, and readers block until the data they want is there.
+class StreamBuffer
+{
+public:
+    StreamBuffer();
+    ~StreamBuffer();
+
+    // Returns null on failure
+    static QSharedPointer<StreamBuffer> fromFile(const QString &fileName, QString *error);
+
+    void append(const char *data, qint64 size);
+    void finish();
+    // Wakes up everyone waiting for data, and makes them give up
+    void abort();
+
+    bool isFinished() const;
+    qint64 size() const;
+
+    // Blocks until there is something at pos or everything has been
+    // received. Returns 0 at the end, -1 if the thread got interrupted or
+    // we were aborted.
+    qint64 read(qint64 pos, char *data, qint64 maxSize) const;
+
+    // Blocks until there is data at pos, the end is reached or we're aborted
+    bool waitForData(qint64 pos) const;
+
+    // The first size bytes, or less if the input is shorter
+    QByteArray header(qint64 size) const;
+
+private:
+    bool reserve(qint64 size);
+
+    mutable QMutex m_mutex;
+    mutable QWaitCondition m_wakeup;
+    char *m_data = nullptr;
+    qint64 m_size = 0;
+    bool m_finished = false;
+    bool m_aborted = false;
+
+    // If we're mapping a file
+    QScopedPointer<QFile> m_file;
+
+    // Otherwise it's our own mapping, backed by a memfd if possible
+    qint64 m_mappedSize = 0;
+    int m_memfd = -1;
+};
+
+// Random access device on top of a StreamBuffer, so the image plugins
+// can use it like a normal file while it's still being received.
+class StreamDevice : public QIODevice
+{
+public:
+    explicit StreamDevice(const QSharedPointer<StreamBuffer> &stream, QObject *parent = nullptr) :
+        QIODevice(parent),
+        m_stream(stream)
+    {
+    }
+
+    bool isSequential() const override { return false; }
+
+    // Only what we have so far, until everything is received
+    qint64 size() const override { return m_stream->size(); }
+
+    bool atEnd() const override { return !m_stream->waitForData(pos()); }
+    qint64 bytesAvailable() const override {
+        m_stream->waitForData(pos());
+        return qMax(m_stream->size() - pos(), qint64(0));
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override {
+        return m_stream->read(pos(), data, maxSize);
+    }
+
+    qint64 writeData(const char *, qint64) override {
+        return -1;
+    }
+
+private:
+    QSharedPointer<StreamBuffer> m_stream;
+};
+
+// Reads stdin into a StreamBuffer as it arrives. Another descriptor (e.g.
+// the stdin of a client of the daemon) can be given, it is then closed when
+// we're done.
+class StdinReader : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit StdinReader(int descriptor = 0, QObject *parent = nullptr);
+    ~StdinReader();
+
+    QSharedPointer<StreamBuffer> stream() const { return m_stream; }
+
+protected:
+    void run() override;
+
+private:
+    QSharedPointer<StreamBuffer> m_stream;
+    const int m_descriptor;
+};
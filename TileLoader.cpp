@@ -0,0 +1,134 @@
+#include "TileLoader.h"
+
+#include "ColorManager.h"
+#include "InterruptibleDevice.h"
+#include "Profiler.h"
+#include "StreamBuffer.h"
+
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QDebug>
+
+// Above this many pixels we don't decode the whole image at once
+static const qint64 s_tilingThreshold = 64 * 1024 * 1024;
+
+// Tiles are decoded together up to this many pixels, enough for a screen
+static const qint64 s_maxBatchPixels = 16 * 1024 * 1024;
+
+TileLoader::TileLoader(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, const QSize &imageSize, QObject *parent) :
+    QThread(parent),
+    m_stream(stream),
+    m_format(format),
+    m_imageSize(imageSize)
+{
+    qRegisterMetaType<TileKey>("TileKey");
+
+    while (levelSize(m_topLevel).width() > s_tileSize || levelSize(m_topLevel).height() > s_tileSize) {
+        m_topLevel++;
+    }
+}
+
+TileLoader::~TileLoader()
+{
+    requestInterruption();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_wakeup.wakeAll();
+    }
+    wait();
+}
+
+bool TileLoader::shouldTile(QImageReader *reader)
+{
+    const QSize size = reader->size();
+    if (!size.isValid() || qint64(size.width()) * size.height() < s_tilingThreshold) {
+        return false;
+    }
+    // Otherwise QImageReader decodes everything and crops it afterwards
+    return reader->supportsOption(QImageIOHandler::ScaledSize) && reader->supportsOption(QImageIOHandler::ScaledClipRect);
+}
+
+QSize TileLoader::levelSize(int level) const
+{
+    const int scale = 1 << level;
+    return QSize((m_imageSize.width() + scale - 1) / scale, (m_imageSize.height() + scale - 1) / scale);
+}
+
+QRect TileLoader::tileRect(const TileKey &key) const
+{
+    const QRect rect(key.x * s_tileSize, key.y * s_tileSize, s_tileSize, s_tileSize);
+    return rect & QRect(QPoint(0, 0), levelSize(key.level));
+}
+
+void TileLoader::request(const QVector<TileKey> &tiles)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue = tiles;
+    for (const TileKey &key : m_decoding) {
+        m_queue.removeAll(key);
+    }
+    m_wakeup.wakeAll();
+}
+
+void TileLoader::run()
+{
+    while (!isInterruptionRequested()) {
+        QVector<TileKey> batch;
+        QRect area;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !isInterruptionRequested()) {
+                m_decoding.clear();
+                m_wakeup.wait(&m_mutex);
+            }
+            if (isInterruptionRequested()) {
+                return;
+            }
+
+            // Most decoders decode everything before clipping, so the tiles
+            // of the same level are decoded in one go.
+            const TileKey first = m_queue.takeFirst();
+            batch.append(first);
+            area = tileRect(first);
+            for (int i = 0; i < m_queue.count();) {
+                const QRect united = area | tileRect(m_queue[i]);
+                if (m_queue[i].level == first.level && qint64(united.width()) * united.height() <= s_maxBatchPixels) {
+                    area = united;
+                    batch.append(m_queue.takeAt(i));
+                } else {
+                    i++;
+                }
+            }
+            m_decoding = batch;
+        }
+        const int level = batch.first().level;
+
+        ProfileScope scope("decode tiles");
+        scope.setArg("level", level);
+        scope.setArg("tiles", batch.count());
+
+        StreamDevice file(m_stream);
+        file.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+        InterruptibleDevice device(&file, this);
+        device.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+
+        // The clip rect is in the coordinates of the scaled image
+        QImageReader reader(&device, m_format);
+        reader.setScaledSize(levelSize(level));
+        reader.setScaledClipRect(area);
+
+        QImage image;
+        if (!reader.read(&image)) {
+            if (!isInterruptionRequested()) {
+                qWarning() << "Failed to decode tiles" << level << area << reader.errorString();
+            }
+            continue;
+        }
+        if (m_colorManaged) {
+            ColorManager::convert(&image);
+        }
+        for (const TileKey &key : batch) {
+            emit tileLoaded(key, image.copy(tileRect(key).translated(-area.topLeft())));
+        }
+    }
+}
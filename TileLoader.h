@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QThread>
+#include <QImage>
+#include <QVector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSharedPointer>
+#include <QMetaType>
+#include <QHash>
+
+class QImageReader;
+class StreamBuffer;
+
+// A tile of the image scaled down by 2^level
+struct TileKey {
+    int level = 0;
+    int x = 0;
+    int y = 0;
+
+    bool operator==(const TileKey &other) const {
+        return level == other.level && x == other.x && y == other.y;
+    }
+    friend uint qHash(const TileKey &key, uint seed = 0) {
+        return qHash(key.level, seed) ^ qHash(key.x << 8) ^ qHash(key.y << 20);
+    }
+};
+Q_DECLARE_METATYPE(TileKey)
+
+// For images too big to decode in one go, decodes only the tiles asked for
+// with QImageReader's scaled clip rect. The tiles of a level that are asked
+// for together are decoded with one clip rect, so the decoder only has to go
+// through the image once for each screen, not once for each tile.
+class TileLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    static const int s_tileSize = 512;
+
+    TileLoader(const QSharedPointer<StreamBuffer> &stream, const QByteArray &format, const QSize &imageSize, QObject *parent = nullptr);
+    ~TileLoader();
+
+    // If the image is big enough to need it, and the format can decode
+    // parts of it scaled.
+    static bool shouldTile(QImageReader *reader);
+
+    // Replaces whatever hasn't been decoded yet, in order of priority
+    void request(const QVector<TileKey> &tiles);
+
+    QSize levelSize(int level) const;
+    // In the coordinates of the level
+    QRect tileRect(const TileKey &key) const;
+    // The whole image fits in one tile
+    int topLevel() const { return m_topLevel; }
+
+    // Call before starting, ColorManager needs to be initialized
+    void setColorManaged(bool colorManaged) { m_colorManaged = colorManaged; }
+
+signals:
+    void tileLoaded(const TileKey &key, const QImage &image);
+
+protected:
+    void run() override;
+
+private:
+    const QSharedPointer<StreamBuffer> m_stream;
+    const QByteArray m_format;
+    const QSize m_imageSize;
+    int m_topLevel = 0;
+    bool m_colorManaged = false;
+
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    QVector<TileKey> m_queue;
+    QVector<TileKey> m_decoding;
+};
@@ -1,6 +1,18 @@
 #include "Viewer.h"
 
 #include "imgeffects.h"
+#include "mipmaps.h"
+#include "magnify.h"
+#include "formats.h"
+#include "ImageLoader.h"
+#include "Scaler.h"
+#include "AnimationPlayer.h"
+#include "StreamBuffer.h"
+#include "Profiler.h"
+#include "Prefetcher.h"
+#include "DiskCache.h"
+#include "ColorManager.h"
+#include "Prober.h"
 
 #include <QKeyEvent>
 #include <QPainter>
@@ -9,20 +21,24 @@
 #include <QX11Info>
 #include <QImageReader>
 #include <QGuiApplication>
-#include <QBuffer>
 #include <QMetaEnum>
 #include <QColorSpace>
 #include <QElapsedTimer>
 #include <QTimer>
 #include <QString>
+#include <QFileInfo>
+#include <QThreadPool>
+#include <QPointer>
+#include <QList>
 
 #ifdef DEBUG_LOAD_TIME
 #include <QElapsedTimer>
 #endif//DEBUG_LOAD_TIME
 
+#include <unistd.h>
+
 extern "C" {
 #include <xcb/xcb_icccm.h>
-#include <unistd.h>
 }
 
 static const QString s_helpText = QStringLiteral(
@@ -33,23 +49,121 @@ static const QString s_helpText = QStringLiteral(
         "Escape/Q: Quit\n"
         "F: Maximize\n"
         "I: Show/hide image info\n"
+        "P: Show/hide performance\n"
+        "J/K: Next/previous image\n"
         "1-0: Zoom 10-100%\n"
         "Space: Toggle animation\n"
         "W: Speed up animation\n"
         "S: Slow down animation\n"
         "D: Step animation forward\n"
         "A: Step animation backward\n"
+        "Home/End: First/last frame\n"
+        "Z: Pixel peeping (drag to move)\n"
         "E: Equalize\n"
         "N: Normalize\n"
         "Backspace: Reset\n"
         "?: Show/hide this message"
     );
 
+// In kB
+static const int s_effectCacheSize = 256 * 1024;
+
+// Decoded images we keep around when browsing, in kB
+static const int s_imageCacheSize = 512 * 1024;
+
+// How many screens worth of tiles we keep around
+static const int s_tileCacheScreens = 8;
+
+// Whole numbers so pixels stay square when pixel peeping
+static const int s_peepZooms[] = { 1, 2, 3, 4, 6, 8, 12, 16, 24, 32 };
+
+// How many images in each direction to decode ahead of time
+static const int s_prefetchCount = 2;
 
-Viewer::Viewer()
+// Decoding threads we moved on from, some plugins can't be interrupted in
+// the middle of a decode so they finish on their own. They are waited for
+// when we exit, so they don't outlive the plugins.
+static QList<QPointer<QThread>> s_retiredThreads;
+
+static void waitForRetiredThreads()
+{
+    for (const QPointer<QThread> &thread : s_retiredThreads) {
+        if (thread) {
+            thread->wait();
+        }
+    }
+    s_retiredThreads.clear();
+}
+
+// Doesn't block, the thread is deleted once it is done
+static void retireThread(QThread *thread, QObject *receiver)
+{
+    if (!thread) {
+        return;
+    }
+    QObject::disconnect(thread, nullptr, receiver, nullptr);
+    thread->requestInterruption();
+    QObject::connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+    if (!thread->isRunning()) {
+        delete thread;
+        return;
+    }
+
+    static bool registered = false;
+    if (!registered) {
+        qAddPostRoutine(waitForRetiredThreads);
+        registered = true;
+    }
+    s_retiredThreads.removeAll(nullptr);
+    s_retiredThreads.append(thread);
+}
+
+Viewer::Viewer() :
+    m_inputDescriptor(STDIN_FILENO)
 {
     qRegisterMetaType<QImageReader::ImageReaderError>("QImageReader::ImageReaderError");
     setFlag(Qt::Dialog);
+    m_effectCache.setMaxCost(s_effectCacheSize);
+    m_imageCache.setMaxCost(s_imageCacheSize);
+}
+
+Viewer::~Viewer()
+{
+    if (m_stream) {
+        m_stream->abort();
+    }
+    retireThread(m_loader.take(), this);
+    if (m_tileLoader) {
+        // Wakes it up if it's waiting for requests
+        m_tileLoader->requestInterruption();
+        m_tileLoader->request({});
+    }
+    retireThread(m_tileLoader.take(), this);
+
+    if (m_inputDescriptor != STDIN_FILENO) {
+        ::close(m_inputDescriptor);
+    }
+}
+
+void Viewer::setInputDescriptor(int descriptor)
+{
+    if (m_inputDescriptor != STDIN_FILENO) {
+        ::close(m_inputDescriptor);
+    }
+    m_inputDescriptor = descriptor;
+}
+
+void Viewer::setColorManaged(bool colorManaged)
+{
+    if (colorManaged) {
+        ColorManager::initialize();
+    }
+    m_colorManaged = colorManaged;
+}
+
+bool Viewer::isValid() const
+{
+    return (m_movie && m_movie->isValid()) || !m_image.isNull() || !m_overview.isNull();
 }
 
 bool Viewer::load(const QString &filename)
@@ -57,75 +171,510 @@ bool Viewer::load(const QString &filename)
 #ifdef DEBUG_LOAD_TIME
     QElapsedTimer t; t.start();
 #endif
-    QIODevice *device = nullptr;
-    if (filename == "-") {
-        QFile stdinFile;
-        stdinFile.open(STDIN_FILENO, QIODevice::ReadOnly, QFileDevice::DontCloseHandle);
+    bool shown = false;
+    if (!openInput(filename, &shown)) {
+        return false;
+    }
+    if (shown) {
+        return true;
+    }
 
-        m_buffer = stdinFile.readAll();
-        device = new QBuffer(&m_buffer, this);
+    ProbeResult probe = Prober::probe(m_stream);
+    if (!probe.canRead && useFallbackPlugins(probe.sniffedFormat)) {
+        probe = Prober::probe(m_stream);
+    }
+    if (!startDecoding(filename, probe)) {
+        return false;
+    }
+#ifdef DEBUG_LOAD_TIME
+    qDebug() << "Image probed in" << t.elapsed() << "ms";
+#endif//DEBUG_LOAD_TIME
+    return true;
+}
+
+void Viewer::loadInBackground(const QString &filename)
+{
+    bool shown = false;
+    if (!openInput(filename, &shown) || shown) {
+        emit probed(shown);
+        return;
+    }
+    startProber(filename);
+}
+
+void Viewer::startProber(const QString &filename)
+{
+    m_prober.reset(new Prober(m_stream));
+    connect(m_prober.data(), &QThread::finished, this, [this, filename]() {
+            const ProbeResult probe = m_prober->result();
+            if (!probe.canRead && useFallbackPlugins(probe.sniffedFormat)) {
+                startProber(filename);
+                return;
+            }
+            emit probed(startDecoding(filename, probe));
+        });
+    m_prober->start();
+}
+
+bool Viewer::openInput(const QString &filename, bool *shown)
+{
+    if (filename != "-") {
+        m_currentFile = filename;
+        if (const DecodedImage *decoded = m_imageCache.object(filename)) {
+            showDecoded(*decoded);
+            *shown = true;
+            return true;
+        }
+    }
+
+    // Everything reads from the same mapping of the input
+    if (filename == "-") {
+        // Probing and decoding blocks until enough has arrived, so we can
+        // show the window as soon as we have the header.
+        m_stdinReader.reset(new StdinReader(m_inputDescriptor));
+        m_inputDescriptor = STDIN_FILENO;
+        m_stdinReader->start();
+        m_stream = m_stdinReader->stream();
     } else {
-        m_fileName = filename;
-        device = new QFile(filename, this);
+        QString error;
+        m_stream = StreamBuffer::fromFile(filename, &error);
+        if (!m_stream) {
+            qWarning() << "Failed to open" << filename << error;
+            return false;
+        }
+
+        if (m_useDiskCache) {
+            m_diskCacheKey = DiskCache::key(filename, m_colorManaged);
+        }
+        if (!m_diskCacheKey.isEmpty()) {
+            m_diskCached.reset(new CachedImage);
+            if (DiskCache::load(m_diskCacheKey, m_diskCached.data())) {
+                showDiskCached();
+                *shown = true;
+                return true;
+            }
+        }
     }
+    return true;
+}
 
-    if (!device->open(QIODevice::ReadOnly)) {
-        qWarning() << "Failed to open" << filename << device->errorString();
+// True if the plugins on disk were added, and it's worth probing again
+bool Viewer::useFallbackPlugins(const QByteArray &sniffedFormat)
+{
+    if (m_fallbackPluginPaths.isEmpty() || QImageReader::supportedImageFormats().contains(sniffedFormat)) {
         return false;
     }
+    QCoreApplication::setLibraryPaths(m_fallbackPluginPaths);
+    m_fallbackPluginPaths.clear();
+    return true;
+}
 
-    QImageReader reader(device);
-
-    if (!reader.canRead()) {
-        m_error = reader.error();
-        qWarning().noquote() << "Error trying to read image from" << filename << ":" << reader.errorString();
+bool Viewer::startDecoding(const QString &filename, const ProbeResult &probe)
+{
+    if (!probe.canRead) {
+        m_error = probe.error;
+        qWarning().noquote() << "Error trying to read image from" << filename << ":" << probe.errorString;
     }
-    m_format = reader.format();
-    if (!reader.subType().isEmpty()) {
-        m_format += "/" + reader.subType();
+    m_format = probe.format;
+    m_imageSize = probe.size;
+    m_readerFormat = probe.readerFormat;
+    if (m_diskCached) {
+        m_diskCached->readerFormat = m_readerFormat;
+        m_diskCached->format = m_format;
+        m_diskCached->animated = probe.animated;
     }
-    m_imageSize = reader.size();
 
-    if (reader.supportsAnimation()) {
+    if (probe.animated) {
         static const QSet<QByteArray> brokenFormats = {
             "mng"
         };
-        reader.setDevice(nullptr);
-        device->deleteLater();
 
-        resetMovie();
-        m_brokenFormat = brokenFormats.contains(m_movie->format());
+        m_brokenFormat = brokenFormats.contains(m_readerFormat);
         if (m_brokenFormat) {
-            qWarning() << m_movie->format() << "has issues, playback might get janky";
+            qWarning() << m_readerFormat << "has issues, playback might get janky";
         }
 
         if (!m_imageSize.isValid()) {
-            m_movie->start();
-            m_imageSize = m_movie->currentImage().size();
-            if (!m_imageSize.isValid()) {
-                m_imageSize = QSize(10, 10);
-            }
+            // Fixed up when we get the first frame
+            m_waitingForSize = true;
+            m_imageSize = screen()->availableSize() / 2;
         }
-        if (m_imageSize.isValid()) {
+        resetMovie();
+        if (!m_waitingForSize) {
             m_movie->setScaledSize(m_imageSize);
-        } else {
-            qWarning() << "Failed to get size from animated image";
-            return false;
         }
     } else {
-        reader.read(&m_image);
-        reader.setDevice(nullptr);
-        device->deleteLater();
-        if (m_image.isNull()) {
-            qWarning() << "Image reader error:" << reader.errorString();
+        if (!probe.canRead) {
             return false;
         }
-        m_imageSize = m_image.size();
+
+        // If the decoder can scale while decoding, only decode what fits on
+        // the screen first, and get the full resolution afterwards.
+        const QSize screenSize = screen()->availableSize();
+        QSize previewSize;
+        if (m_imageSize.isValid() &&
+                (m_imageSize.width() > screenSize.width() || m_imageSize.height() > screenSize.height()) &&
+                probe.supportsScaledSize) {
+            previewSize = m_imageSize.scaled(screenSize, Qt::KeepAspectRatio);
+        }
+        if (probe.shouldTile) {
+            startTiled();
+        } else {
+            startLoader(previewSize);
+        }
+
+        if (!m_imageSize.isValid()) {
+            // Header didn't tell us, fix it up when we have the image
+            m_imageSize = screenSize / 2;
+        }
     }
     m_scaledSize = m_imageSize;
-#ifdef DEBUG_LOAD_TIME
-    qDebug() << "Image loaded in" << t.elapsed() << "ms";
-#endif//DEBUG_LOAD_TIME
+    initGeometry();
+
+    return true;
+}
+
+void Viewer::startLoader(const QSize &previewSize)
+{
+    // Decoding can take a long time, so do it in a separate thread and
+    // show the window based on the size from the header in the meantime.
+    m_loader.reset(new ImageLoader(m_stream, m_readerFormat));
+    m_loader->setColorManaged(m_colorManaged);
+    if (previewSize.isValid()) {
+        m_loader->setPreviewSize(previewSize);
+    }
+    connect(m_loader.data(), &ImageLoader::previewLoaded, this, &Viewer::onPreviewLoaded);
+    connect(m_loader.data(), &ImageLoader::decoded, this, [this](qint64 decodeTime) {
+            m_decodeTime = decodeTime;
+            if (m_showPerformance) {
+                update();
+            }
+        });
+    connect(m_loader.data(), &ImageLoader::imageLoaded, this, &Viewer::onFullResolutionLoaded);
+    connect(m_loader.data(), &ImageLoader::mipmapsLoaded, this, &Viewer::onMipmapsLoaded);
+    connect(m_loader.data(), &ImageLoader::loadFailed, this, &Viewer::onLoadFailed);
+    m_loading = true;
+    m_loader->start();
+}
+
+void Viewer::startTiled()
+{
+    m_tileLoader.reset(new TileLoader(m_stream, m_readerFormat, m_imageSize));
+    m_tileLoader->setColorManaged(m_colorManaged);
+    connect(m_tileLoader.data(), &TileLoader::tileLoaded, this, &Viewer::onTileLoaded);
+
+    // Depends on the screen, not the image
+    const QSize screenSize = screen()->size();
+    m_tileCache.setMaxCost(qint64(screenSize.width()) * screenSize.height() * 4 * s_tileCacheScreens / 1024);
+
+    // Shown until we have the tiles
+    TileKey overview;
+    overview.level = m_tileLoader->topLevel();
+    m_tileLoader->request({ overview });
+    m_loading = true;
+    m_tileLoader->start();
+}
+
+void Viewer::onTileLoaded(const TileKey &key, const QImage &image)
+{
+    if (sender() != m_tileLoader.data()) {
+        // From the previous image
+        return;
+    }
+    if (key.level == m_tileLoader->topLevel()) {
+        m_overview = image;
+        m_loading = false;
+    } else {
+        m_tileCache.insert(key, new QImage(image), qMax<qint64>(image.sizeInBytes() / 1024, 1));
+    }
+    m_peepImage = QImage();
+    update();
+}
+
+void Viewer::paintTiles(QPainter *painter, const QRect &imageRect)
+{
+    // Only the part that is on the screen
+    const QRect screenGeometry = screen()->geometry();
+    const QRect visible = imageRect & rect() & QRect(mapFromGlobal(screenGeometry.topLeft()), screenGeometry.size());
+    if (visible.isEmpty()) {
+        return;
+    }
+
+    // The smallest level that still has at least as many pixels as we show
+    const qreal scale = qreal(imageRect.width()) / m_imageSize.width();
+    int level = 0;
+    while (level < m_tileLoader->topLevel() && (2 << level) * scale <= 1.) {
+        level++;
+    }
+    const QSize levelSize = m_tileLoader->levelSize(level);
+    const qreal scaleX = qreal(imageRect.width()) / levelSize.width();
+    const qreal scaleY = qreal(imageRect.height()) / levelSize.height();
+
+    const int tileSize = TileLoader::s_tileSize;
+    const int firstX = qMax(int((visible.left() - imageRect.left()) / scaleX) / tileSize, 0);
+    const int firstY = qMax(int((visible.top() - imageRect.top()) / scaleY) / tileSize, 0);
+    const int lastX = qMin(int((visible.right() - imageRect.left()) / scaleX) / tileSize, (levelSize.width() - 1) / tileSize);
+    const int lastY = qMin(int((visible.bottom() - imageRect.top()) / scaleY) / tileSize, (levelSize.height() - 1) / tileSize);
+
+    painter->setRenderHint(QPainter::SmoothPixmapTransform);
+    QVector<TileKey> missing;
+    for (int y = firstY; y <= lastY; y++) {
+        for (int x = firstX; x <= lastX; x++) {
+            TileKey key;
+            key.level = level;
+            key.x = x;
+            key.y = y;
+            const QRect tile = m_tileLoader->tileRect(key);
+            const QRectF target(imageRect.left() + tile.x() * scaleX, imageRect.top() + tile.y() * scaleY,
+                    tile.width() * scaleX, tile.height() * scaleY);
+
+            if (level == m_tileLoader->topLevel()) {
+                painter->drawImage(target, m_overview);
+            } else if (const QImage *image = m_tileCache.object(key)) {
+                painter->drawImage(target, *image);
+            } else {
+                missing.append(key);
+                paintFallbackTile(painter, key, target);
+            }
+        }
+    }
+    m_tileLoader->request(missing);
+}
+
+void Viewer::paintFallbackTile(QPainter *painter, const TileKey &key, const QRectF &target)
+{
+    // Blurry from a smaller level until we have it
+    const QRect tile = m_tileLoader->tileRect(key);
+    for (int level = key.level + 1; level <= m_tileLoader->topLevel(); level++) {
+        const int shift = level - key.level;
+        TileKey parent;
+        parent.level = level;
+        parent.x = key.x >> shift;
+        parent.y = key.y >> shift;
+
+        const QImage *image = level == m_tileLoader->topLevel() ? &m_overview : m_tileCache.object(parent);
+        if (!image || image->isNull()) {
+            continue;
+        }
+        const QRect parentTile = m_tileLoader->tileRect(parent);
+        const qreal scale = 1 << shift;
+        const QRectF source(tile.x() / scale - parentTile.x(), tile.y() / scale - parentTile.y(),
+                tile.width() / scale, tile.height() / scale);
+        painter->drawImage(target, *image, source);
+        return;
+    }
+    painter->fillRect(target, Qt::black);
+}
+
+QPointF Viewer::imagePosition(const QPoint &pos) const
+{
+    if (m_peepZoom) {
+        return QPointF(m_peepOffset + pos) / m_peepZoom;
+    }
+    QRect imageRect(QPoint(0, 0), m_scaledSize);
+    imageRect.moveCenter(rect().center());
+    const QPoint relative = pos - imageRect.topLeft();
+    return QPointF(relative.x() * qreal(m_imageSize.width()) / m_scaledSize.width(),
+            relative.y() * qreal(m_imageSize.height()) / m_scaledSize.height());
+}
+
+// Keeps the image point under pos where it is
+void Viewer::setPeepZoom(int zoom, const QPoint &pos)
+{
+    if (!zoom) {
+        m_peepZoom = 0;
+        m_peepImage = QImage();
+        update();
+        return;
+    }
+    const QPointF imagePos = imagePosition(pos);
+    m_peepZoom = zoom;
+    m_peepOffset = (imagePos * zoom).toPoint() - pos;
+    clampPeepOffset();
+
+    if (m_decodeDeferred) {
+        // Only had what fits on the screen
+        m_decodeDeferred = false;
+        startLoader(QSize());
+    }
+    update();
+}
+
+int Viewer::nextPeepZoom(int step) const
+{
+    const int count = sizeof(s_peepZooms) / sizeof(s_peepZooms[0]);
+    int index = 0;
+    while (index < count - 1 && s_peepZooms[index] < m_peepZoom) {
+        index++;
+    }
+    index += step;
+    if (index < 0) {
+        // Zoomed out of it
+        return 0;
+    }
+    return s_peepZooms[qMin(index, count - 1)];
+}
+
+void Viewer::clampPeepOffset()
+{
+    // Centered if it is smaller than the window
+    const QSize magnified = m_imageSize * m_peepZoom;
+    if (magnified.width() <= width()) {
+        m_peepOffset.setX(-(width() - magnified.width()) / 2);
+    } else {
+        m_peepOffset.setX(qBound(0, m_peepOffset.x(), magnified.width() - width()));
+    }
+    if (magnified.height() <= height()) {
+        m_peepOffset.setY(-(height() - magnified.height()) / 2);
+    } else {
+        m_peepOffset.setY(qBound(0, m_peepOffset.y(), magnified.height() - height()));
+    }
+}
+
+// Only magnifies what is visible, and only when that changed
+QImage Viewer::peepImage(const QRect &visible)
+{
+    const QPoint offset = visible.topLeft() + m_peepOffset;
+    if (!m_peepImage.isNull() && m_peepImage.size() == visible.size() &&
+            m_peepImageOffset == offset && m_peepImageZoom == m_peepZoom) {
+        return m_peepImage;
+    }
+
+    const int zoom = m_peepZoom;
+    const QRect sourceRect(QPoint(offset.x() / zoom, offset.y() / zoom),
+            QPoint((offset.x() + visible.width() - 1) / zoom, (offset.y() + visible.height() - 1) / zoom));
+    const QImage source = peepSource(sourceRect);
+    if (source.isNull()) {
+        return QImage();
+    }
+
+    ProfileScope scope("magnify");
+    scope.setArg("zoom", zoom);
+    QImage magnified(visible.size(), source.format());
+    magnifyNearest(source, offset - sourceRect.topLeft() * zoom, zoom, &magnified);
+
+    m_peepImage = magnified;
+    m_peepImageOffset = offset;
+    m_peepImageZoom = zoom;
+    return magnified;
+}
+
+// The full resolution pixels in sourceRect, in a format we can magnify
+QImage Viewer::peepSource(const QRect &sourceRect)
+{
+    if (m_tileLoader) {
+        QImage source(sourceRect.size(), QImage::Format_ARGB32_Premultiplied);
+        source.fill(Qt::black);
+        QPainter painter(&source);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+
+        const int tileSize = TileLoader::s_tileSize;
+        QVector<TileKey> missing;
+        for (int y = sourceRect.top() / tileSize; y <= sourceRect.bottom() / tileSize; y++) {
+            for (int x = sourceRect.left() / tileSize; x <= sourceRect.right() / tileSize; x++) {
+                TileKey key;
+                key.x = x;
+                key.y = y;
+                const QImage *tile = m_tileCache.object(key);
+                if (!tile) {
+                    missing.append(key);
+                    continue;
+                }
+                const QRect tileRect = m_tileLoader->tileRect(key);
+                painter.drawImage(tileRect.topLeft() - sourceRect.topLeft(), *tile);
+            }
+        }
+        // Redone when they arrive
+        m_tileLoader->request(missing);
+        return source;
+    }
+
+    if (m_image.isNull() || m_isPreview) {
+        // Still loading the full resolution
+        return QImage();
+    }
+    QImage image = m_image;
+    if (m_effect != None) {
+        // Of the whole image, so the histogram is the same as when it isn't
+        // magnified, and kept so moving around doesn't redo it.
+        const EffectCacheKey key = { -1, m_effect, m_image.size() };
+        if (const QImage *cached = m_effectCache.object(key)) {
+            image = *cached;
+        } else {
+            ProfileScope effectScope(m_effect == Equalize ? "equalize" : "normalize");
+            QElapsedTimer timer;
+            timer.start();
+            if (m_effect == Equalize) {
+                equalize(image);
+            } else {
+                normalize(image);
+            }
+            m_effectTime = timer.nsecsElapsed() / 1000;
+            m_effectCache.insert(key, new QImage(image), image.sizeInBytes() / 1024);
+        }
+    }
+    QImage source = image.copy(sourceRect);
+    switch (source.format()) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        return source;
+    default:
+        return source.convertToFormat(source.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    }
+}
+
+void Viewer::showDiskCached()
+{
+    m_imageSize = m_diskCached->imageSize;
+    m_scaledSize = m_imageSize;
+    m_readerFormat = m_diskCached->readerFormat;
+    m_format = m_diskCached->format;
+
+    if (m_diskCached->animated) {
+        // The decoder plays the cached frames, they have the size they were
+        // last shown at
+        resetMovie();
+        m_movie->setScaledSize(m_diskCached->frames.first().size());
+    } else {
+        // Only decode the real thing if the user zooms in past this
+        m_image = m_diskCached->frames.first();
+        m_isPreview = true;
+        m_previewSize = m_image.size();
+        m_decodeDeferred = true;
+        m_diskCacheKey.clear();
+        m_diskCached.reset();
+    }
+    initGeometry();
+    updateScaled();
+    update();
+}
+
+void Viewer::storeInDiskCache()
+{
+    CachedImage cached = *m_diskCached;
+    cached.imageSize = m_image.size();
+    cached.delays = { 0 };
+    m_diskCached.reset();
+
+    QSize size = m_image.size();
+    const QSize screenSize = screen()->availableSize();
+    if (size.width() > screenSize.width() || size.height() > screenSize.height()) {
+        size.scale(screenSize, Qt::KeepAspectRatio);
+    }
+    const QImage source = bestMipmap(m_mipmaps, size);
+    const QString key = m_diskCacheKey;
+
+    // Writing can take a while, and we don't need to wait for it
+    QThreadPool::globalInstance()->start([=]() {
+            CachedImage screenSized = cached;
+            screenSized.frames = { source.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation) };
+            DiskCache::store(key, screenSized);
+        });
+}
+
+void Viewer::initGeometry()
+{
     QSize minSize = m_imageSize;
     minSize.scale(100, 100, Qt::KeepAspectRatio);
     setMinimumSize(minSize);
@@ -134,100 +683,285 @@ bool Viewer::load(const QString &filename)
     maxSize.scale(screen()->availableSize() * 2, Qt::KeepAspectRatioByExpanding);
     setMaximumSize(maxSize);
 
-    updateSize(m_imageSize, true);
+    updateSize(openedSize(m_imageSize, screen()->availableSize()), true);
+}
 
-    return true;
+QSize Viewer::openedSize(const QSize &imageSize, const QSize &availableSize)
+{
+    // The window gets this size from updateSize(), and the image fills it
+    QSize size = imageSize;
+    if (size.width() > availableSize.width() || size.height() >= availableSize.height()) {
+        size.scale(availableSize, Qt::KeepAspectRatio);
+    }
+    // The minimum size initGeometry() sets
+    size = size.expandedTo(imageSize.scaled(100, 100, Qt::KeepAspectRatio));
+    return imageSize.scaled(size, Qt::KeepAspectRatio);
 }
 
 void Viewer::resetMovie()
 {
-    m_decodeSuccess = false;
-    m_needReset = false;
+    m_scaledFrame = QImage();
+    m_scaledFrameNumber = -1;
 
-    int speed = -1;
-    QSize scaledSize;
+    const int speed = m_movie ? m_movie->speed() : 100;
+    const QSize scaledSize = m_movie ? m_movie->scaledSize() : QSize();
 
-    if (m_movie) {
-        speed = m_movie->speed();
-        scaledSize = m_movie->scaledSize();
-        m_movie->device()->deleteLater();
+    m_movie.reset(new AnimationPlayer(m_stream, m_readerFormat));
+    m_movie->setColorManaged(m_colorManaged);
+    m_movie->setSpeed(speed);
+    if (m_diskCached) {
+        m_movie->setDiskCache(m_diskCacheKey, *m_diskCached);
     }
-
-    QIODevice *device = nullptr;
-    if (!m_fileName.isEmpty()) {
-        device = new QFile(m_fileName, this);
-    } else {
-        device = new QBuffer(&m_buffer, this);
+    if (scaledSize.isValid()) {
+        m_movie->setScaledSize(scaledSize);
     }
-    device->open(QIODevice::ReadOnly);
-    m_movie.reset(new QMovie(device));
 
-    if (speed > 0 && speed <= 1000) {
-        m_movie->setSpeed(speed);
+    connect(m_movie.data(), &AnimationPlayer::error, this, [](const QString &error) {
+            qWarning() << "Animation decode failed:" << error;
+        });
+    connect(m_movie.data(), &AnimationPlayer::frameChanged, this, &Viewer::onFrameChanged);
+
+    if (m_startFrame >= 0) {
+        // The frame is shown when the decoder gets to it
+        m_movie->jumpToFrame(m_startFrame);
+        m_movie->start();
+        m_movie->setPaused(true);
+        m_startFrame = -1;
+        return;
     }
-    if (scaledSize.isValid()) {
-        m_movie->setScaledSize(scaledSize);
-    } else if (m_imageSize.isValid()) {
+
+    QMetaObject::invokeMethod(m_movie.data(), &AnimationPlayer::start, Qt::QueuedConnection);
+}
+
+void Viewer::onFrameChanged()
+{
+    if (m_waitingForSize) {
+        m_waitingForSize = false;
+        m_imageSize = m_movie->currentImage().size();
+        if (!m_imageSize.isValid()) {
+            m_imageSize = QSize(10, 10);
+        }
+        m_scaledSize = m_imageSize;
         m_movie->setScaledSize(m_imageSize);
+        initGeometry();
     }
 
-    // Completely arbitrary
-    const bool bigImage = m_scaledSize.width()/1000 * m_scaledSize.height() / 1000 > 16;
-    m_movie->setCacheMode(bigImage ? QMovie::CacheNone : QMovie::CacheAll);
+    // Only repaint what changed, if the frame is drawn as is
+    const QImage image = m_movie->currentImage();
+    if (m_movie->state() != AnimationPlayer::Running || m_brokenFormat ||
+            m_effect != None || image.size() != m_scaledSize) {
+        update();
+        return;
+    }
+    QRect imageRect(QPoint(0, 0), m_scaledSize);
+    imageRect.moveCenter(rect().center());
+    const QRect changed = m_movie->currentChangedRect();
+    if (!changed.isEmpty()) {
+        update(changed.translated(imageRect.topLeft()));
+    }
+    if (m_showInfo || m_showHelp || m_showPerformance) {
+        // The text might get wider
+        update(QRect(0, 0, width(), m_overlayRect.height()));
+    }
+}
 
-    QMetaObject::invokeMethod(m_movie.get(), &QMovie::start);
+void Viewer::onPreviewLoaded(const QImage &image)
+{
+    m_image = image;
+    m_isPreview = true;
+    m_previewSize = image.size();
+    updateScaled();
+    update();
+}
 
-    connect(m_movie.get(), &QMovie::error, this, [this]() {
-            qWarning() << "QMovie error" << m_movie->lastErrorString();
-            m_needReset = true;
-        });
+void Viewer::onFullResolutionLoaded(const QImage &image)
+{
+    const bool hadPreview = !m_image.isNull();
+    m_image = image;
+    m_mipmaps.clear();
+    m_isPreview = false;
+    m_loading = false;
+    m_peepImage = QImage();
+    if (m_peepZoom) {
+        update();
+    }
 
-#ifdef DEBUG_MNG
-    m_timer.restart();
-    qDebug() << " - Next delay" << m_movie->nextFrameDelay();
-#endif
+    if (m_image.size() != m_imageSize) {
+        // Header didn't have a (correct) size
+        m_imageSize = m_image.size();
+        m_scaledSize = m_imageSize;
+        initGeometry();
+    }
 
-    connect(m_movie.get(), &QMovie::frameChanged, this, [this](int frameNum) {
-#ifdef DEBUG_MNG
-        qDebug() << " - Now at frame" << frameNum << m_timer.restart() << "elapsed since last";
-        qDebug() << " - Next delay" << m_movie->nextFrameDelay();
-#endif
+    // Only need to redo it if we're showing more than the preview had
+    if (!hadPreview || m_scaledSize.width() > m_previewSize.width() || m_scaledSize.height() > m_previewSize.height()) {
+        updateScaled();
         update();
+    }
+}
 
-        // Basically just the mng reader not providing a delay, we cap at 60fps
-        const int nextFrameDelay = m_movie->nextFrameDelay();
-        if (nextFrameDelay < 16) {
-            m_movie->setPaused(true);
-            QTimer::singleShot(qMin(16 - nextFrameDelay, 16), m_movie.data(), &QMovie::start);
-        }
+void Viewer::onMipmapsLoaded(const QVector<QImage> &levels)
+{
+    m_mipmaps = levels;
+
+    if (m_diskCached && !m_diskCached->animated) {
+        storeInDiskCache();
+    }
 
-        if (!m_movie->currentPixmap().isNull()) {
-            m_decodeSuccess = true;
+    if (!m_files.isEmpty()) {
+        DecodedImage *decoded = new DecodedImage;
+        decoded->image = m_image;
+        decoded->mipmaps = m_mipmaps;
+        if (m_scaledEffect == None && !m_scaledFromPreview) {
+            decoded->scaled = m_scaled;
         }
+        decoded->readerFormat = m_readerFormat;
+        decoded->format = m_format;
+        m_imageCache.insert(m_currentFile, decoded, decoded->cost());
 
-        if (!m_brokenFormat) {
-            return;
+        // Now that we're done with this one
+        prefetchNeighbours();
+    }
+}
+
+void Viewer::onLoadFailed(const QString &error)
+{
+    m_loading = false;
+    if (!m_image.isNull()) {
+        qWarning() << "Failed to load full resolution image:" << error;
+        return;
+    }
+    qWarning() << "Image reader error:" << error;
+    emit loadingFailed();
+
+    if (!m_files.isEmpty()) {
+        prefetchNeighbours();
+    }
+}
+
+bool Viewer::setFiles(const QStringList &fileNames)
+{
+    m_files = fileNames;
+    m_fileIndex = -1;
+    return navigate(1);
+}
+
+bool Viewer::navigate(int step)
+{
+    // Skip the ones we can't load
+    for (int i = 0; i < m_files.count(); i++) {
+        const int index = ((m_fileIndex + step) % m_files.count() + m_files.count()) % m_files.count();
+        clear();
+        m_fileIndex = index;
+        setTitle(QFileInfo(m_files[index]).fileName());
+        if (load(m_files[index])) {
+            if (!m_loading) {
+                prefetchNeighbours();
+            }
+            return true;
         }
-        if (m_movie->frameCount() > 0 && frameNum >= m_movie->frameCount() - 1) {
-            QMetaObject::invokeMethod(this, &Viewer::onMovieFinished, Qt::QueuedConnection);
-            return;
+    }
+    return false;
+}
+
+void Viewer::clear()
+{
+    // Whatever is waiting for a stalled pipe gives up right away
+    if (m_stream) {
+        m_stream->abort();
+    }
+    m_prober.reset();
+    // Don't wait for a decode that is still running
+    retireThread(m_loader.take(), this);
+    m_movie.reset();
+    m_stdinReader.reset();
+    m_stream.clear();
+
+    m_image = QImage();
+    m_scaled = QImage();
+    m_mipmaps.clear();
+    m_scaleGeneration++;
+    m_isPreview = false;
+    m_loading = false;
+    m_previewSize = QSize();
+
+    m_readerFormat.clear();
+    m_format.clear();
+    m_waitingForSize = false;
+    m_brokenFormat = false;
+    m_scaledFrame = QImage();
+    m_scaledFrameNumber = -1;
+    m_effectCache.clear();
+    m_error = QImageReader::UnknownError;
+    m_currentFile.clear();
+
+    m_diskCacheKey.clear();
+    m_diskCached.reset();
+    m_decodeDeferred = false;
+
+    if (m_tileLoader) {
+        m_tileLoader->requestInterruption();
+        m_tileLoader->request({});
+    }
+    retireThread(m_tileLoader.take(), this);
+    m_tileCache.clear();
+    m_overview = QImage();
+
+    m_peepZoom = 0;
+    m_peepImage = QImage();
+
+    m_infoText.clear();
+    m_decodeTime = -1;
+    m_scaleTime = -1;
+    m_effectTime = -1;
+}
+
+void Viewer::showDecoded(const DecodedImage &decoded)
+{
+    m_image = decoded.image;
+    m_mipmaps = decoded.mipmaps;
+    m_scaled = decoded.scaled;
+    m_scaledEffect = None;
+    m_scaledFromPreview = false;
+    m_readerFormat = decoded.readerFormat;
+    m_format = decoded.format;
+    m_imageSize = m_image.size();
+    m_scaledSize = m_imageSize;
+
+    initGeometry();
+    updateScaled();
+    update();
+}
+
+void Viewer::prefetchNeighbours()
+{
+    QStringList fileNames;
+    for (int distance = 1; distance <= s_prefetchCount; distance++) {
+        for (const int direction : { 1, -1 }) {
+            const int index = ((m_fileIndex + distance * direction) % m_files.count() + m_files.count()) % m_files.count();
+            const QString &fileName = m_files[index];
+            if (fileName != m_currentFile && !m_imageCache.contains(fileName) && !fileNames.contains(fileName)) {
+                fileNames.append(fileName);
+            }
         }
-    });
+    }
 
-    connect(m_movie.get(), &QMovie::finished, this, &Viewer::onMovieFinished, Qt::QueuedConnection);
+    if (!m_prefetcher) {
+        m_prefetcher.reset(new Prefetcher);
+        m_prefetcher->setColorManaged(m_colorManaged);
+        connect(m_prefetcher.data(), &Prefetcher::prefetched, this, &Viewer::onPrefetched);
+        m_prefetcher->start();
+    }
+    m_prefetcher->prefetch(fileNames, screen()->availableSize());
 }
 
-void Viewer::onMovieFinished()
+void Viewer::onPrefetched(const QString &fileName, const DecodedImage &decoded)
 {
-    if (!m_decodeSuccess) {
-        qWarning() << "Animation decode failed";
+    if (fileName == m_currentFile) {
+        // Already loaded it ourselves in the meantime
         return;
     }
-    if (m_needReset) {
-        QMetaObject::invokeMethod(this, &Viewer::resetMovie);
-    } else {
-        m_movie->jumpToFrame(0);
-    }
+    m_imageCache.insert(fileName, new DecodedImage(decoded), decoded.cost());
 }
 
 void Viewer::updateSize(QSize newSize, bool initial)
@@ -279,6 +1013,9 @@ void Viewer::ensureVisible()
 
 void Viewer::setAspectRatio()
 {
+    if (!QX11Info::isPlatformX11()) {
+        return;
+    }
     xcb_size_hints_t hints;
     memset(&hints, 0, sizeof(hints));
     xcb_icccm_size_hints_set_aspect(&hints, m_imageSize.width(), m_imageSize.height(), m_imageSize.width(), m_imageSize.height());
@@ -293,6 +1030,7 @@ template <typename ENUM> static const QString enumToString(const ENUM val)
 
 void Viewer::paintEvent(QPaintEvent *event)
 {
+    ProfileScope scope("paintEvent");
     QPainter p(this);
     p.setClipRegion(event->region());
 
@@ -301,30 +1039,74 @@ void Viewer::paintEvent(QPaintEvent *event)
 
     QRect imageRect;
     QImage image;
-    if (m_movie) {
+    if (m_peepZoom) {
+        imageRect = QRect(-m_peepOffset, m_imageSize * m_peepZoom) & rect;
+        image = peepImage(imageRect);
+    } else if (m_movie) {
         imageRect = QRect(QPoint(0, 0), m_scaledSize);
         imageRect.moveCenter(rect.center());
-        if (m_movie->state() != QMovie::Running || m_brokenFormat) {
-            image = m_movie->currentImage().scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        if (m_movie->state() != AnimationPlayer::Running || m_brokenFormat) {
+            // Don't rescale the same frame on every expose, overlay toggle etc.
+            const int frameNumber = m_movie->currentFrameNumber();
+            if (frameNumber != m_scaledFrameNumber || m_scaledFrame.size() != m_scaledSize) {
+                m_scaledFrame = m_movie->currentImage().scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+                m_scaledFrameNumber = frameNumber;
+            }
+            image = m_scaledFrame;
         } else {
             image =  m_movie->currentImage();
         }
-        if (m_effect == Equalize) {
-            equalize(image);
-        } else if (m_effect == Normalize) {
-            normalize(image);
+        if (m_effect != None && !image.isNull()) {
+            // Animations loop, so avoid redoing the same frames every time
+            const EffectCacheKey key = { m_movie->currentFrameNumber(), m_effect, image.size() };
+            if (const QImage *cached = m_effectCache.object(key)) {
+                image = *cached;
+            } else {
+                ProfileScope effectScope(m_effect == Equalize ? "equalize" : "normalize");
+                QElapsedTimer timer;
+                timer.start();
+                if (m_effect == Equalize) {
+                    equalize(image);
+                } else if (m_effect == Normalize) {
+                    normalize(image);
+                }
+                m_effectTime = timer.nsecsElapsed() / 1000;
+                m_effectCache.insert(key, new QImage(image), image.sizeInBytes() / 1024);
+            }
+        }
+    } else if (m_tileLoader) {
+        imageRect = QRect(QPoint(0, 0), m_scaledSize);
+        imageRect.moveCenter(rect.center());
+
+        // Draws what it has, and asks for the rest
+        image = m_overview;
+        if (!image.isNull()) {
+            paintTiles(&p, imageRect);
         }
     } else {
-        imageRect = m_scaled.rect();
+        imageRect = QRect(QPoint(0, 0), m_scaledSize);
         imageRect.moveCenter(rect.center());
 
         image = m_scaled;
     }
     if (image.isNull()) {
-        qWarning() << "Decode failure";
+        p.fillRect(rect, Qt::black);
+        if (m_loading) {
+            p.setPen(Qt::gray);
+            p.drawText(rect, Qt::AlignCenter, QStringLiteral("Loading..."));
+        } else {
+            qWarning() << "Decode failure";
+        }
         return;
     }
-    p.drawImage(imageRect.topLeft(), image);
+    if (m_tileLoader && !m_peepZoom) {
+        // Already drawn
+    } else if (image.size() == imageRect.size()) {
+        p.drawImage(imageRect.topLeft(), image);
+    } else {
+        // Waiting for the properly scaled version, fast and ugly in the meantime
+        p.drawImage(imageRect, image);
+    }
 
     // This _should_ always be empty
     QRegion background = rect;
@@ -334,40 +1116,53 @@ void Viewer::paintEvent(QPaintEvent *event)
         p.fillRect(r, Qt::black);
     }
 
-    QString text;
+    const QString text = overlayText(image);
+    if (text.isEmpty()) {
+        m_overlayRect = QRect();
+        return;
+    }
+    if (text != m_overlayText || m_overlay.devicePixelRatio() != devicePixelRatio()) {
+        ProfileScope overlayScope("overlay");
+        QRect textRect = p.boundingRect(rect, Qt::AlignLeft | Qt::AlignTop, text);
+        textRect += QMargins(2, 2, 2, 2);
+        textRect.moveTo(0, 0);
+
+        m_overlay = QImage(textRect.size() * devicePixelRatio(), QImage::Format_ARGB32_Premultiplied);
+        m_overlay.setDevicePixelRatio(devicePixelRatio());
+        m_overlay.fill(QColor(0, 0, 0, 128));
+        QPainter overlayPainter(&m_overlay);
+        overlayPainter.setFont(p.font());
+        overlayPainter.setPen(Qt::white);
+        overlayPainter.drawText(textRect, text);
+        m_overlayText = text;
+    }
+    p.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    p.drawImage(0, 0, m_overlay);
+    m_overlayRect = QRect(QPoint(0, 0), m_overlay.size() / m_overlay.devicePixelRatio());
+}
+
+QString Viewer::overlayText(const QImage &image)
+{
     if (m_showHelp) {
-        text = s_helpText;
-    } else if (m_showInfo) {
-        p.setCompositionMode(QPainter::CompositionMode_SourceOver);
-        text += enumToString(image.format());
-        text += "\nSize: " + QString::asprintf("%dx%d", m_imageSize.width(), m_imageSize.height());
-        text += "\nFormat: " + m_format;
-
-        QColorSpace colors = image.colorSpace();
-        if (colors.isValid() || image.colorCount()) {
-            text += "\nColors:";
-            if (colors.gamma()) {
-                text += "\n  Gamma: " + QString::number(colors.gamma());
-            }
-            if (colors.isValid()) {
-                text += "\n  Primaries: " + enumToString(colors.primaries());
-                text += "\n  Transfer function: " + enumToString(colors.transferFunction());
-            }
-            if (image.colorCount()) {
-                text += "\n  Color count: " + QString::number(image.colorCount());
-            }
+        return s_helpText;
+    }
+
+    QString text;
+    if (m_showInfo) {
+        // All the frames of an animation have the same info
+        const qint64 infoKey = m_movie ? 0 : image.cacheKey();
+        if (m_infoText.isEmpty() || infoKey != m_infoKey) {
+            m_infoText = imageInfo(image);
+            m_infoKey = infoKey;
         }
 
-        if (!image.textKeys().isEmpty()) {
-            text += "\nMetadata:";
-            for (const QString &key : image.textKeys()) {
-                QString text = image.text(key).simplified();
-                //text.remove("\n");
-                if (text.length() > 25) {
-                    text = text.mid(0, 22) + "...";
-                }
-                text += "\n - " + key + ": " + text;
-            }
+        text += "Size: " + QString::asprintf("%dx%d", m_imageSize.width(), m_imageSize.height());
+        if (m_isPreview) {
+            text += m_loading ? " (loading full resolution)" : " (cached)";
+        }
+        text += "\n" + m_infoText;
+        if (m_peepZoom) {
+            text += "\nZoom: " + QString::number(m_peepZoom * 100) + "%";
         }
 
         if (m_movie) {
@@ -381,15 +1176,100 @@ void Viewer::paintEvent(QPaintEvent *event)
             text += "\n" + enumToString(m_movie->state());
         }
     }
-    if (!text.isEmpty()) {
-        p.setCompositionMode(QPainter::CompositionMode_SourceOver);
-        QRect textRect = p.boundingRect(rect, Qt::AlignLeft | Qt::AlignTop, text);
-        textRect += QMargins(2, 2, 2, 2);
-        textRect.moveTo(0, 0);
-        p.fillRect(textRect, QColor(0, 0, 0, 128));
-        p.setPen(Qt::white);
-        p.drawText(textRect, text);
+    if (m_tileLoader && m_effect != None) {
+        // The histogram of each tile is different, so they wouldn't match
+        if (!text.isEmpty()) {
+            text += "\n";
+        }
+        text += "Effects are off for tiled images";
+    }
+    if (m_showPerformance) {
+        if (!text.isEmpty()) {
+            text += "\n";
+        }
+        text += performanceInfo();
     }
+    return text;
+}
+
+QString Viewer::imageInfo(const QImage &image) const
+{
+    QString text = enumToString(image.format());
+    text += "\nFormat: " + m_format;
+
+    QColorSpace colors = image.colorSpace();
+    if (colors.isValid() || image.colorCount()) {
+        text += "\nColors:";
+        if (colors.gamma()) {
+            text += "\n  Gamma: " + QString::number(colors.gamma());
+        }
+        if (colors.isValid()) {
+            text += "\n  Primaries: " + enumToString(colors.primaries());
+            text += "\n  Transfer function: " + enumToString(colors.transferFunction());
+        }
+        if (image.colorCount()) {
+            text += "\n  Color count: " + QString::number(image.colorCount());
+        }
+    }
+
+    if (!image.textKeys().isEmpty()) {
+        text += "\nMetadata:";
+        for (const QString &key : image.textKeys()) {
+            QString value = image.text(key).simplified();
+            if (value.length() > 25) {
+                value = value.mid(0, 22) + "...";
+            }
+            text += "\n - " + key + ": " + value;
+        }
+    }
+    return text;
+}
+
+static QString formatTime(qint64 microseconds)
+{
+    if (microseconds < 0) {
+        return QStringLiteral("-");
+    }
+    return QString::number(microseconds / 1000., 'f', 1) + " ms";
+}
+
+QString Viewer::performanceInfo() const
+{
+    QString text;
+    if (m_movie) {
+        // Of the frame we're showing
+        text += "Decode: " + formatTime(m_movie->currentDecodeTime());
+        text += "\nScale: " + formatTime(m_movie->currentScaleTime());
+    } else {
+        text += "Decode: " + formatTime(m_decodeTime);
+        text += "\nScale: " + formatTime(m_scaleTime);
+    }
+    if (m_effect != None) {
+        text += "\nEffect: " + formatTime(m_effectTime);
+    }
+    if (m_movie) {
+        text += "\nInterval: " + QString::number(m_movie->actualInterval()) +
+            " ms (wants " + QString::number(m_movie->requestedInterval()) + " ms)";
+        text += "\nLate frames: " + QString::number(m_movie->lateFrames());
+    }
+    text += "\nMemory: " + QString::number(memoryUsage() / (1024 * 1024)) + " MB";
+    return text;
+}
+
+qint64 Viewer::memoryUsage() const
+{
+    qint64 bytes = m_image.sizeInBytes() + m_scaled.sizeInBytes() + m_scaledFrame.sizeInBytes() +
+        m_overview.sizeInBytes() + m_peepImage.sizeInBytes() + m_overlay.sizeInBytes();
+    // The first level is the image itself
+    for (int i = 1; i < m_mipmaps.count(); i++) {
+        bytes += m_mipmaps[i].sizeInBytes();
+    }
+    // These count in kB
+    bytes += (qint64(m_effectCache.totalCost()) + m_imageCache.totalCost() + m_tileCache.totalCost()) * 1024;
+    if (m_movie) {
+        bytes += m_movie->memoryUsage();
+    }
+    return bytes;
 }
 
 
@@ -399,6 +1279,11 @@ void Viewer::wheelEvent(QWheelEvent *event)
     if (!numDegrees) {
         return;
     }
+    if (m_peepZoom) {
+        // Around the cursor
+        setPeepZoom(nextPeepZoom(numDegrees > 0 ? 1 : -1), event->position().toPoint());
+        return;
+    }
     const qreal delta = 1. + qAbs(numDegrees / 800.);
     if (numDegrees > 0) {
         updateSize(m_scaledSize * delta);
@@ -409,6 +1294,28 @@ void Viewer::wheelEvent(QWheelEvent *event)
 
 void Viewer::keyPressEvent(QKeyEvent *event)
 {
+    if (m_peepZoom) {
+        // Zooms inside the window instead of resizing it
+        switch(event->key()) {
+        case Qt::Key_Equal:
+        case Qt::Key_Plus:
+        case Qt::Key_Up:
+        case Qt::Key_PageUp:
+            setPeepZoom(nextPeepZoom(1), rect().center());
+            return;
+        case Qt::Key_Minus:
+        case Qt::Key_Down:
+        case Qt::Key_PageDown:
+            setPeepZoom(nextPeepZoom(-1), rect().center());
+            return;
+        case Qt::Key_Backspace:
+            setPeepZoom(0, QPoint());
+            break;
+        default:
+            break;
+        }
+    }
+
     const QSize screenSize = screen()->availableSize();
     QSize fullSize = m_imageSize.scaled(screenSize, Qt::KeepAspectRatio);
     switch(event->key()) {
@@ -437,7 +1344,7 @@ void Viewer::keyPressEvent(QKeyEvent *event)
         if (!m_movie) {
             return;
         }
-        if (m_movie->state() == QMovie::Running) {
+        if (m_movie->state() == AnimationPlayer::Running) {
             m_movie->setPaused(true);
         } else {
             m_movie->setPaused(false);
@@ -472,6 +1379,7 @@ void Viewer::keyPressEvent(QKeyEvent *event)
         } else {
             m_effect = Normalize;
         }
+        m_peepImage = QImage();
         updateScaled();
         update();
         break;
@@ -481,6 +1389,7 @@ void Viewer::keyPressEvent(QKeyEvent *event)
         } else {
             m_effect = Equalize;
         }
+        m_peepImage = QImage();
         updateScaled();
         update();
         break;
@@ -496,6 +1405,20 @@ void Viewer::keyPressEvent(QKeyEvent *event)
             m_movie->jumpToFrame(m_movie->currentFrameNumber() + 1);
         }
         return;
+    case Qt::Key_Home:
+        if (!m_movie) {
+            return;
+        }
+        m_movie->setPaused(true);
+        m_movie->jumpToFrame(0);
+        return;
+    case Qt::Key_End:
+        if (!m_movie || !m_movie->frameCount()) {
+            return;
+        }
+        m_movie->setPaused(true);
+        m_movie->jumpToFrame(m_movie->frameCount() - 1);
+        return;
     case Qt::Key_Equal:
     case Qt::Key_Plus:
     case Qt::Key_Up:
@@ -545,10 +1468,36 @@ void Viewer::keyPressEvent(QKeyEvent *event)
         setGeometry(geom);
         break;
     }
+    case Qt::Key_Z: {
+        if (m_movie || m_imageSize.isEmpty() || m_scaledSize.isEmpty()) {
+            return;
+        }
+        if (m_peepZoom) {
+            setPeepZoom(0, QPoint());
+            return;
+        }
+        // Starts at 100% around the cursor
+        QPoint pos = mapFromGlobal(QCursor::pos());
+        if (!rect().contains(pos)) {
+            pos = rect().center();
+        }
+        setPeepZoom(1, pos);
+        return;
+    }
+    case Qt::Key_J:
+        navigate(1);
+        return;
+    case Qt::Key_K:
+        navigate(-1);
+        return;
     case Qt::Key_I:
         m_showInfo = !m_showInfo;
         update();
         break;
+    case Qt::Key_P:
+        m_showPerformance = !m_showPerformance;
+        update();
+        break;
     case Qt::Key_Question:
         m_showHelp = !m_showHelp;
         update();
@@ -561,41 +1510,73 @@ void Viewer::keyPressEvent(QKeyEvent *event)
 
 void Viewer::updateScaled()
 {
-    if (m_movie) {
+    if (m_movie || m_tileLoader) {
+        // Scaled when painting
         return;
     }
-#ifdef DEBUG_LOAD_TIME
-    QElapsedTimer t; t.start();
-#endif
-    const Qt::TransformationMode mode = Qt::SmoothTransformation;
-    const bool scalingUp = m_image.width() < width();
+    if (m_image.isNull()) {
+        // Still loading
+        return;
+    }
+    ProfileScope scope("updateScaled");
+    Scaler::Request request;
+    request.size = m_imageSize.scaled(size(), Qt::KeepAspectRatio);
+    if (m_decodeDeferred && (request.size.width() > m_previewSize.width() || request.size.height() > m_previewSize.height())) {
+        // Zoomed in past what the disk cache had
+        m_decodeDeferred = false;
+        startLoader(QSize());
+    }
+    if (m_scaled.size() == request.size && m_scaledEffect == m_effect && !m_scaledFromPreview) {
+        // E.g. from the cache, but make sure an older request doesn't replace it
+        m_scaleGeneration++;
+        return;
+    }
+    request.effect = m_effect;
+    m_requestedEffect = m_effect;
+    m_requestedFromPreview = m_isPreview;
+    request.effectFirst = m_imageSize.width() < width();
+    request.generation = ++m_scaleGeneration;
 
-    m_scaled = m_image;
-    if (scalingUp) {
-        if (m_effect == Equalize) {
-            equalize(m_scaled);
-        } else if (m_effect == Normalize) {
-            normalize(m_scaled);
-        }
+    if (request.effectFirst || m_mipmaps.isEmpty()) {
+        request.source = m_image;
+    } else {
+        // Avoid scaling down from the full resolution every time
+        request.source = bestMipmap(m_mipmaps, request.size);
     }
-    m_scaled = m_scaled.scaled(size(), Qt::KeepAspectRatio, Qt::SmoothTransformation);
-    if (!scalingUp) {
-        if (m_effect == Equalize) {
-            equalize(m_scaled);
-        } else if (m_effect == Normalize) {
-            normalize(m_scaled);
-        }
+
+    // paintEvent() just stretches the old one until this is done
+    if (!m_scaler) {
+        m_scaler.reset(new Scaler);
+        connect(m_scaler.data(), &Scaler::timings, this, [this](qint64 scaleTime, qint64 effectTime) {
+                m_scaleTime = scaleTime;
+                m_effectTime = effectTime;
+            });
+        connect(m_scaler.data(), &Scaler::scaled, this, &Viewer::onScaled);
+        m_scaler->start();
     }
-#ifdef DEBUG_LOAD_TIME
-    qDebug() << "Effect applied in" << t.elapsed() << "ms";
-#endif
+    m_scaler->scale(request);
+}
+
+void Viewer::onScaled(const QImage &image, int generation)
+{
+    if (generation != m_scaleGeneration) {
+        // Outdated, there's a newer one coming
+        return;
+    }
+    m_scaled = image;
+    m_scaledEffect = m_requestedEffect;
+    m_scaledFromPreview = m_requestedFromPreview;
+    update();
 }
 
 void Viewer::resizeEvent(QResizeEvent *event)
 {
     m_scaledSize = m_imageSize.scaled(size(), Qt::KeepAspectRatio);
+    if (m_peepZoom) {
+        clampPeepOffset();
+    }
     if (m_movie) {
-        if (!m_brokenFormat) {
+        if (!m_brokenFormat && !m_waitingForSize) {
             m_movie->setScaledSize(m_scaledSize);
         }
     } else {
@@ -630,8 +1611,15 @@ void Viewer::mouseMoveEvent(QMouseEvent *ev)
         return;
     }
     const QPoint delta = ev->globalPos() - m_lastMousePos;
-    setPosition(position() + delta);
     m_lastMousePos = ev->globalPos();
+    if (m_peepZoom) {
+        // Moves the image instead of the window
+        m_peepOffset -= delta;
+        clampPeepOffset();
+        update();
+        return;
+    }
+    setPosition(position() + delta);
 }
 
 bool Viewer::event(QEvent *ev)
@@ -4,13 +4,27 @@
 #include <QImage>
 #include <QScopedPointer>
 #include <QElapsedTimer>
-#include <QMovie>
+#include <QImageReader>
 #include <QPointer>
+#include <QCache>
+#include <QHash>
+#include <QSharedPointer>
+#include <QStringList>
 
-//#define DEBUG_MNG
+#include "TileLoader.h"
 
-class QMovie;
+class AnimationPlayer;
 class QIODevice;
+class QPainter;
+class ImageLoader;
+class Scaler;
+class StreamBuffer;
+class StdinReader;
+class Prefetcher;
+class Prober;
+struct ProbeResult;
+struct DecodedImage;
+struct CachedImage;
 
 class Viewer : public QRasterWindow
 {
@@ -18,24 +32,59 @@ class Viewer : public QRasterWindow
 
 public:
     Viewer();
+    ~Viewer();
 
+    // Blocks until the header has arrived, so not for pipes
     bool load(const QString &filename);
 
-    bool isValid() {
-        return (m_movie && m_movie->isValid()) || !m_image.isNull();
-    }
+    // Doesn't wait for the input to arrive, emits probed() once it knows if
+    // it can show it.
+    void loadInBackground(const QString &filename);
+
+    // For browsing through several images, loads the first one that works
+    bool setFiles(const QStringList &fileNames);
+
+    bool isValid() const;
     QImageReader::ImageReaderError error() const { return m_error; }
 
+    // For animations, call before load()
+    void setStartFrame(int frameNumber) { m_startFrame = frameNumber; }
+
+    // Where "-" is read from instead of stdin, we take ownership of it
+    void setInputDescriptor(int descriptor);
+
+    // Used if the image format isn't built in
+    void setFallbackPluginPaths(const QStringList &paths) { m_fallbackPluginPaths = paths; }
+
+    // What a newly opened image is shown at, on a screen with availableSize
+    static QSize openedSize(const QSize &imageSize, const QSize &availableSize);
+
+    // Call before load()
+    void setDiskCacheEnabled(bool enabled) { m_useDiskCache = enabled; }
+    void setColorManaged(bool colorManaged);
+
     enum Effect {
         None,
         Normalize,
         Equalize
     };
 
+signals:
+    // From loadInBackground(), with what load() would have returned
+    void probed(bool loaded);
+    void loadingFailed();
+
 private slots:
     void setAspectRatio();
     void resetMovie();
-    void onMovieFinished();
+    void onFrameChanged();
+    void onPreviewLoaded(const QImage &image);
+    void onFullResolutionLoaded(const QImage &image);
+    void onMipmapsLoaded(const QVector<QImage> &levels);
+    void onScaled(const QImage &image, int generation);
+    void onLoadFailed(const QString &error);
+    void onPrefetched(const QString &fileName, const DecodedImage &decoded);
+    void onTileLoaded(const TileKey &key, const QImage &image);
 
 protected:
     void paintEvent(QPaintEvent*) override;
@@ -49,35 +98,134 @@ protected:
     bool event(QEvent *event) override;
 
 private:
+    struct EffectCacheKey {
+        int frame;
+        Effect effect;
+        QSize size;
+
+        bool operator==(const EffectCacheKey &other) const {
+            return frame == other.frame && effect == other.effect && size == other.size;
+        }
+        friend uint qHash(const EffectCacheKey &key, uint seed = 0) {
+            return qHash(key.frame, seed) ^ qHash(int(key.effect)) ^ qHash(key.size.width()) ^ qHash(key.size.height() << 16);
+        }
+    };
+
+    void initGeometry();
     void updateSize(QSize newSize, bool initial = false);
     void ensureVisible();
     void updateScaled();
+    void clear();
+    void showDecoded(const DecodedImage &decoded);
+    void showDiskCached();
+    bool openInput(const QString &filename, bool *shown);
+    void startProber(const QString &filename);
+    bool useFallbackPlugins(const QByteArray &sniffedFormat);
+    bool startDecoding(const QString &filename, const ProbeResult &probe);
+    void startLoader(const QSize &previewSize);
+    void startTiled();
+    void paintTiles(QPainter *painter, const QRect &imageRect);
+    void paintFallbackTile(QPainter *painter, const TileKey &key, const QRectF &target);
+    QPointF imagePosition(const QPoint &pos) const;
+    void setPeepZoom(int zoom, const QPoint &pos);
+    int nextPeepZoom(int step) const;
+    void clampPeepOffset();
+    QImage peepImage(const QRect &visible);
+    QImage peepSource(const QRect &sourceRect);
+    void storeInDiskCache();
+    QString overlayText(const QImage &image);
+    QString imageInfo(const QImage &image) const;
+    QString performanceInfo() const;
+    qint64 memoryUsage() const;
+    bool navigate(int step);
+    void prefetchNeighbours();
 
     QImage m_image;
     QImage m_scaled;
+    QVector<QImage> m_mipmaps;
+    QScopedPointer<Scaler> m_scaler;
+    int m_scaleGeneration = 0;
+    // What the latest scaled image was made from
+    Effect m_requestedEffect = None;
+    Effect m_scaledEffect = None;
+    bool m_requestedFromPreview = false;
+    bool m_scaledFromPreview = false;
+    QScopedPointer<ImageLoader> m_loader;
+    bool m_isPreview = false;
+    bool m_loading = false;
+    QSize m_previewSize;
     QSize m_imageSize;
     QSize m_scaledSize;
     QImageReader::ImageReaderError m_error = QImageReader::UnknownError;
 
-    QScopedPointer<QMovie> m_movie;
-    bool m_decodeSuccess = false;
-    bool m_needReset = false;
+    QScopedPointer<AnimationPlayer> m_movie;
+    QByteArray m_readerFormat;
+    bool m_waitingForSize = false;
+    int m_startFrame = -1;
+    QImage m_scaledFrame;
+    int m_scaledFrameNumber = -1;
 
     QPoint m_lastMousePos;
     bool m_brokenFormat = false;
 
-    QString m_fileName;
-    QByteArray m_buffer;
+    QSharedPointer<StreamBuffer> m_stream;
+    QScopedPointer<StdinReader> m_stdinReader;
+    QScopedPointer<Prober> m_prober;
+    int m_inputDescriptor;
+    QStringList m_fallbackPluginPaths;
+    bool m_useDiskCache = false;
+    bool m_colorManaged = false;
+
+    QStringList m_files;
+    int m_fileIndex = -1;
+    QString m_currentFile;
+    QScopedPointer<Prefetcher> m_prefetcher;
+    QCache<QString, DecodedImage> m_imageCache;
+
+    // Set if the current file should be stored in the disk cache, or if it
+    // is an animation that was loaded from it.
+    QString m_diskCacheKey;
+    QScopedPointer<CachedImage> m_diskCached;
+    // Showing a screen sized image from the disk cache, and haven't needed
+    // the full resolution yet.
+    bool m_decodeDeferred = false;
+
+    // For images too big to decode all at once
+    QScopedPointer<TileLoader> m_tileLoader;
+    QCache<TileKey, QImage> m_tileCache;
+    // The whole image in one tile
+    QImage m_overview;
+
+    // Pixel peeping, magnified by m_peepZoom (0 when off) in a window that
+    // keeps its size. The offset is of the window in magnified pixels.
+    int m_peepZoom = 0;
+    QPoint m_peepOffset;
+    // What we magnified last, null if the source changed
+    QImage m_peepImage;
+    QPoint m_peepImageOffset;
+    int m_peepImageZoom = 0;
 
     bool m_showInfo = false;
     QString m_format;
 
     Effect m_effect = None;
+    QCache<EffectCacheKey, QImage> m_effectCache;
 
     bool m_showHelp = false;
-
-#ifdef DEBUG_MNG
-    QElapsedTimer m_timer;
-#endif
+    // Where the info or help text was last painted
+    QRect m_overlayRect;
+
+    // The text is only laid out again when it changes
+    QImage m_overlay;
+    QString m_overlayText;
+    // The part of the info that only changes with the image
+    QString m_infoText;
+    qint64 m_infoKey = 0;
+
+    // Live numbers instead of the profiler, times are in microseconds
+    bool m_showPerformance = false;
+    qint64 m_decodeTime = -1;
+    qint64 m_scaleTime = -1;
+    qint64 m_effectTime = -1;
 };
 
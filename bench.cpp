@@ -0,0 +1,502 @@
+#include "Viewer.h"
+#include "ImageLoader.h"
+#include "Scaler.h"
+#include "AnimationPlayer.h"
+#include "StreamBuffer.h"
+#include "imgeffects.h"
+#include "mipmaps.h"
+
+#include <QGuiApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include <QTemporaryDir>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QDebug>
+
+#include <algorithm>
+
+// Headless benchmark of the load, scale, effect and animation paths, run
+// with the offscreen platform. Prints the results as JSON.
+
+// Give up on anything that takes longer than this
+static const int s_timeout = 60 * 1000;
+
+struct Result {
+    QString name;
+    QVector<double> samples; // in ms
+    double fps = 0;
+};
+
+static QVector<Result> s_results;
+
+static double percentile(QVector<double> sorted, double fraction)
+{
+    if (sorted.isEmpty()) {
+        return 0;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    const int index = qBound(0, int(fraction * sorted.count() + 0.5) - 1, sorted.count() - 1);
+    return sorted[index];
+}
+
+static double elapsedMs(const QElapsedTimer &timer)
+{
+    return timer.nsecsElapsed() / 1000000.;
+}
+
+static void addResult(const QString &name, const QVector<double> &samples, double fps = 0)
+{
+    Result result;
+    result.name = name;
+    result.samples = samples;
+    result.fps = fps;
+    s_results.append(result);
+
+    qInfo().noquote() << QString::asprintf("%-40s p50 %8.2f ms  p95 %8.2f ms  p99 %8.2f ms", qPrintable(name),
+            percentile(samples, 0.5), percentile(samples, 0.95), percentile(samples, 0.99))
+        << (fps > 0 ? QString::asprintf(" %6.1f fps", fps) : QString());
+}
+
+// Runs the event loop until quit() is called on it, or it times out
+static bool runLoop(QEventLoop *loop)
+{
+    QTimer timeout;
+    timeout.setSingleShot(true);
+    bool timedOut = false;
+    QObject::connect(&timeout, &QTimer::timeout, loop, [&]() {
+        timedOut = true;
+        loop->quit();
+    });
+    timeout.start(s_timeout);
+    loop->exec();
+    if (timedOut) {
+        qWarning() << "Timed out";
+    }
+    return !timedOut;
+}
+
+// Qt can't write gifs, so we write them uncompressed: a clear code often
+// enough that the LZW code size never grows past 9 bits.
+static bool writeGif(const QString &fileName, const QVector<QImage> &frames, int delay)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly) || frames.isEmpty()) {
+        return false;
+    }
+    const QSize size = frames.first().size();
+    const QVector<QRgb> colors = frames.first().colorTable();
+
+    QByteArray data("GIF89a");
+    auto write16 = [&](int value) {
+        data.append(char(value & 0xff));
+        data.append(char((value >> 8) & 0xff));
+    };
+    write16(size.width());
+    write16(size.height());
+    data.append(char(0xf7)); // 256 entry global color table
+    data.append(char(0));
+    data.append(char(0));
+    for (int i = 0; i < 256; i++) {
+        const QRgb color = i < colors.count() ? colors[i] : 0;
+        data.append(char(qRed(color)));
+        data.append(char(qGreen(color)));
+        data.append(char(qBlue(color)));
+    }
+    if (frames.count() > 1) {
+        data.append("\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 19);
+    }
+
+    for (const QImage &frame : frames) {
+        data.append("\x21\xf9\x04\x00", 4);
+        write16(delay / 10);
+        data.append(char(0));
+        data.append(char(0));
+
+        data.append(char(0x2c));
+        write16(0);
+        write16(0);
+        write16(size.width());
+        write16(size.height());
+        data.append(char(0));
+        data.append(char(8)); // minimum code size
+
+        QByteArray codes;
+        quint32 bits = 0;
+        int bitCount = 0;
+        auto writeCode = [&](int code) {
+            bits |= code << bitCount;
+            bitCount += 9;
+            while (bitCount >= 8) {
+                codes.append(char(bits & 0xff));
+                bits >>= 8;
+                bitCount -= 8;
+            }
+        };
+        int sinceClear = 0;
+        for (int y = 0; y < size.height(); y++) {
+            const uchar *line = frame.constScanLine(y);
+            for (int x = 0; x < size.width(); x++) {
+                if (sinceClear == 0) {
+                    writeCode(256);
+                }
+                writeCode(line[x]);
+                sinceClear = (sinceClear + 1) % 250;
+            }
+        }
+        writeCode(257);
+        if (bitCount > 0) {
+            codes.append(char(bits & 0xff));
+        }
+        for (int i = 0; i < codes.size(); i += 255) {
+            const int blockSize = qMin(255, codes.size() - i);
+            data.append(char(blockSize));
+            data.append(codes.constData() + i, blockSize);
+        }
+        data.append(char(0));
+    }
+    data.append(char(0x3b));
+    return file.write(data) == data.size();
+}
+
+static QImage gradientImage(const QSize &size, QImage::Format format)
+{
+    QImage image(size, format);
+    for (int y = 0; y < size.height(); y++) {
+        QRgb *line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < size.width(); x++) {
+            // Some high frequency noise so it doesn't compress to nothing
+            const int noise = ((x * 7919) ^ (y * 104729)) & 0x1f;
+            const int alpha = format == QImage::Format_RGB32 ? 255 : 128 + (x * 127 / size.width());
+            line[x] = qPremultiply(qRgba(x * 255 / size.width(), y * 255 / size.height(), noise * 8, alpha));
+        }
+    }
+    return image;
+}
+
+static QVector<QImage> animationFrames(const QSize &size, int count)
+{
+    QVector<QRgb> colors;
+    for (int i = 0; i < 256; i++) {
+        colors.append(qRgb(i, 255 - i, (i * 3) & 0xff));
+    }
+
+    QVector<QImage> frames;
+    for (int i = 0; i < count; i++) {
+        QImage frame(size, QImage::Format_Indexed8);
+        frame.setColorTable(colors);
+        for (int y = 0; y < size.height(); y++) {
+            uchar *line = frame.scanLine(y);
+            for (int x = 0; x < size.width(); x++) {
+                line[x] = (x + y) & 0x7f;
+            }
+        }
+        // A moving box, like most of a screen recording being static
+        const int boxSize = size.height() / 4;
+        const int boxX = (i * 8) % (size.width() - boxSize);
+        for (int y = boxSize; y < boxSize * 2; y++) {
+            memset(frame.scanLine(y) + boxX, 128 + (i & 0x7f), boxSize);
+        }
+        frames.append(frame);
+    }
+    return frames;
+}
+
+static QStringList createCorpus(const QString &path)
+{
+    QStringList files;
+    qInfo() << "Creating test images in" << path;
+
+    const QImage photo = gradientImage(QSize(6000, 4000), QImage::Format_RGB32);
+    if (photo.save(path + "/large.jpg", "jpeg", 90)) {
+        files.append(path + "/large.jpg");
+    }
+    if (photo.copy(0, 0, 4000, 3000).save(path + "/large.png", "png")) {
+        files.append(path + "/large.png");
+    }
+    if (writeGif(path + "/indexed.gif", animationFrames(QSize(2000, 2000), 1), 0)) {
+        files.append(path + "/indexed.gif");
+    }
+    if (writeGif(path + "/animation.gif", animationFrames(QSize(640, 360), 300), 40)) {
+        files.append(path + "/animation.gif");
+    }
+    return files;
+}
+
+static QImage benchmarkDecode(const QString &fileName, int iterations)
+{
+    const QString name = QFileInfo(fileName).fileName();
+    QVector<double> probeTimes, decodeTimes, mipmapTimes;
+    QImage decoded;
+
+    for (int i = 0; i < iterations; i++) {
+        // The same as when starting up, probing and mapping the window
+        {
+            QElapsedTimer timer;
+            timer.start();
+            Viewer viewer;
+            if (!viewer.load(fileName)) {
+                qWarning() << "Failed to load" << fileName;
+                return QImage();
+            }
+            probeTimes.append(elapsedMs(timer));
+        }
+
+        QString error;
+        const QSharedPointer<StreamBuffer> stream = StreamBuffer::fromFile(fileName, &error);
+        if (!stream) {
+            qWarning() << "Failed to open" << fileName << error;
+            return QImage();
+        }
+        ImageLoader loader(stream, QByteArray());
+        QEventLoop loop;
+        QElapsedTimer timer;
+        QObject::connect(&loader, &ImageLoader::imageLoaded, &loop, [&](const QImage &image) {
+            decodeTimes.append(elapsedMs(timer));
+            decoded = image;
+        });
+        QObject::connect(&loader, &ImageLoader::mipmapsLoaded, &loop, [&]() {
+            mipmapTimes.append(elapsedMs(timer));
+            loop.quit();
+        });
+        QObject::connect(&loader, &ImageLoader::loadFailed, &loop, [&](const QString &message) {
+            qWarning() << "Failed to decode" << fileName << message;
+            loop.quit();
+        });
+        timer.start();
+        loader.start();
+        if (!runLoop(&loop) || decoded.isNull()) {
+            return QImage();
+        }
+    }
+    addResult("load/" + name, probeTimes);
+    addResult("decode/" + name, decodeTimes);
+    addResult("decode+mipmaps/" + name, mipmapTimes);
+    return decoded;
+}
+
+// Resizing the window to these, like updateScaled() does
+static void benchmarkScale(const QString &name, const QImage &image, int iterations)
+{
+    const QVector<QImage> mipmaps = buildMipmaps(image);
+    const QVector<QSize> sizes = { QSize(1920, 1080), QSize(1280, 720), QSize(800, 600), QSize(400, 300) };
+
+    Scaler scaler;
+    scaler.start();
+
+    for (const Viewer::Effect effect : { Viewer::None, Viewer::Normalize }) {
+        QVector<double> times;
+        for (int i = 0; i < iterations; i++) {
+            for (const QSize &windowSize : sizes) {
+                Scaler::Request request;
+                request.size = image.size().scaled(windowSize, Qt::KeepAspectRatio);
+                request.effect = effect;
+                request.source = bestMipmap(mipmaps, request.size);
+                request.generation = i;
+
+                QEventLoop loop;
+                QObject::connect(&scaler, &Scaler::scaled, &loop, &QEventLoop::quit);
+                QElapsedTimer timer;
+                timer.start();
+                scaler.scale(request);
+                if (!runLoop(&loop)) {
+                    return;
+                }
+                times.append(elapsedMs(timer));
+            }
+        }
+        addResult((effect == Viewer::None ? "scale/" : "scale+normalize/") + name, times);
+    }
+}
+
+static void benchmarkEffects(const QString &name, const QImage &image, int iterations)
+{
+    // Effects are applied to the scaled image, so use a screen sized one
+    const QImage scaled = image.scaled(QSize(1920, 1080), Qt::KeepAspectRatio);
+
+    const QVector<QPair<QImage::Format, QString>> formats = {
+        { QImage::Format_ARGB32_Premultiplied, "argb32pm" },
+        { QImage::Format_ARGB32, "argb32" },
+        { QImage::Format_RGB32, "rgb32" },
+    };
+    for (const QPair<QImage::Format, QString> &format : formats) {
+        const QImage source = scaled.convertToFormat(format.first);
+        QVector<double> normalizeTimes, equalizeTimes;
+        for (int i = 0; i < iterations; i++) {
+            QImage copy = source.copy();
+            QElapsedTimer timer;
+            timer.start();
+            normalize(copy);
+            normalizeTimes.append(elapsedMs(timer));
+
+            copy = source.copy();
+            timer.restart();
+            equalize(copy);
+            equalizeTimes.append(elapsedMs(timer));
+        }
+        addResult("normalize/" + format.second + "/" + name, normalizeTimes);
+        addResult("equalize/" + format.second + "/" + name, equalizeTimes);
+    }
+}
+
+static void benchmarkAnimation(const QString &fileName, int loops)
+{
+    const QString name = QFileInfo(fileName).fileName();
+    QString error;
+    const QSharedPointer<StreamBuffer> stream = StreamBuffer::fromFile(fileName, &error);
+    if (!stream) {
+        qWarning() << "Failed to open" << fileName << error;
+        return;
+    }
+
+    // How fast the decoder can produce frames, at a typical window size
+    {
+        AnimationDecoder decoder(stream, QByteArray());
+        decoder.setScaledSize(QSize(1280, 720));
+
+        QVector<QVector<double>> times(loops);
+        QEventLoop loop;
+        QElapsedTimer timer;
+        int loopNumber = 0;
+        bool failed = false;
+        QObject::connect(&decoder, &AnimationDecoder::frameDecoded, &loop, [&]() {
+            AnimationDecoder::Frame frame;
+            while (decoder.takeFrame(0, &frame)) {
+                if (frame.number == 0 && !times[loopNumber].isEmpty()) {
+                    loopNumber++;
+                    if (loopNumber >= loops) {
+                        loop.quit();
+                        return;
+                    }
+                }
+                times[loopNumber].append(elapsedMs(timer));
+                timer.restart();
+            }
+        });
+        QObject::connect(&decoder, &AnimationDecoder::decodeFailed, &loop, [&](const QString &message) {
+            qWarning() << "Failed to decode" << fileName << message;
+            failed = true;
+            loop.quit();
+        });
+        timer.start();
+        decoder.start();
+        if (!runLoop(&loop) || failed) {
+            return;
+        }
+        for (int i = 0; i < loops; i++) {
+            double total = 0;
+            for (double time : times[i]) {
+                total += time;
+            }
+            addResult(QString("decode frames/loop %1/").arg(i + 1) + name, times[i], total > 0 ? times[i].count() * 1000. / total : 0);
+        }
+    }
+
+    // Playback, how late frames are shown compared to their delay
+    {
+        AnimationPlayer player(stream, QByteArray());
+        player.setScaledSize(QSize(1280, 720));
+
+        QVector<double> lateness;
+        QEventLoop loop;
+        QElapsedTimer timer;
+        int expectedDelay = -1;
+        QElapsedTimer total;
+        QObject::connect(&player, &AnimationPlayer::frameChanged, &loop, [&](int) {
+            if (expectedDelay >= 0) {
+                lateness.append(elapsedMs(timer) - expectedDelay);
+            }
+            timer.restart();
+            expectedDelay = player.nextFrameDelay();
+            if (lateness.count() >= 200) {
+                loop.quit();
+            }
+        });
+        QObject::connect(&player, &AnimationPlayer::error, &loop, &QEventLoop::quit);
+        total.start();
+        timer.start();
+        player.start();
+        if (!runLoop(&loop)) {
+            return;
+        }
+        addResult("playback lateness/" + name, lateness, lateness.count() * 1000. / elapsedMs(total));
+    }
+}
+
+static void printUsage(const char *app)
+{
+    qInfo() << "Usage:" << app << "[--iterations=N] [--output=results.json] [images...]";
+    qInfo() << "Without any images a set of test images is generated.";
+}
+
+int main(int argc, char *argv[])
+{
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+
+    int iterations = 10;
+    QString outputFile;
+    QStringList files;
+    for (const QString &arg : app.arguments().mid(1)) {
+        if (arg.startsWith("--iterations=")) {
+            iterations = qMax(arg.section(QLatin1Char('='), 1).toInt(), 1);
+        } else if (arg.startsWith("--output=")) {
+            outputFile = arg.section(QLatin1Char('='), 1);
+        } else if (arg.startsWith("-")) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            files.append(arg);
+        }
+    }
+
+    QTemporaryDir corpusDir;
+    if (files.isEmpty()) {
+        files = createCorpus(corpusDir.path());
+    }
+
+    for (const QString &fileName : files) {
+        QImageReader reader(fileName);
+        if (reader.supportsAnimation() && reader.imageCount() > 1) {
+            benchmarkAnimation(fileName, 2);
+            continue;
+        }
+        const QImage image = benchmarkDecode(fileName, iterations);
+        if (image.isNull()) {
+            continue;
+        }
+        const QString name = QFileInfo(fileName).fileName();
+        benchmarkScale(name, image, iterations);
+        benchmarkEffects(name, image, iterations);
+    }
+
+    QJsonArray results;
+    for (const Result &result : s_results) {
+        QJsonObject object;
+        object["name"] = result.name;
+        object["samples"] = result.samples.count();
+        object["p50"] = percentile(result.samples, 0.5);
+        object["p95"] = percentile(result.samples, 0.95);
+        object["p99"] = percentile(result.samples, 0.99);
+        if (result.fps > 0) {
+            object["fps"] = result.fps;
+        }
+        results.append(object);
+    }
+    const QByteArray json = QJsonDocument(QJsonObject{{"results", results}}).toJson();
+    if (outputFile.isEmpty()) {
+        fputs(json.constData(), stdout);
+        return 0;
+    }
+    QFile file(outputFile);
+    if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+        qWarning() << "Failed to write" << outputFile << file.errorString();
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#ifndef COLORLUT_H
+#define COLORLUT_H
+
+#include "imgeffects.h"
+#include "parallel.h"
+
+#include <QImage>
+#include <QVector>
+
+// A 3D lookup table from one colour space to another, sampled on a grid and
+// interpolated between the four grid points of the tetrahedron each pixel is
+// in. Only for 32 bit pixels that are not premultiplied.
+struct ColorLut {
+    static const int s_gridSize = 33;
+
+    // Blue, green, red and padding for every grid point, with blue changing
+    // fastest. 255 is stored as 255 * 128, so it fits in a signed 16 bit
+    // value for _mm_madd_epi16() and weights up to 256.
+    QVector<qint16> table;
+
+    // For each 8 bit value the grid point below it, and the weight (0-256)
+    // of the one above it.
+    quint8 index[256];
+    qint16 weight[256];
+};
+
+static const int s_lutStrideBlue = 4;
+static const int s_lutStrideGreen = ColorLut::s_gridSize * 4;
+static const int s_lutStrideRed = ColorLut::s_gridSize * ColorLut::s_gridSize * 4;
+
+static void initLutIndices(ColorLut *lut)
+{
+    const int steps = ColorLut::s_gridSize - 1;
+    for (int value = 0; value < 256; value++) {
+        // In 1/256 of a grid step
+        const int position = value * steps * 256 / 255;
+        int index = position >> 8;
+        int weight = position & 255;
+        if (index == steps) {
+            index = steps - 1;
+            weight = 256;
+        }
+        lut->index[value] = index;
+        lut->weight[value] = weight;
+    }
+}
+
+// The first corner of the tetrahedron, the offsets of the two in between
+// and the weights of all four. The last corner is always the opposite one.
+static inline const qint16 *lutCorners(const ColorLut &lut, QRgb pixel, int *first, int *second, int weights[4])
+{
+    const int red = qRed(pixel);
+    const int green = qGreen(pixel);
+    const int blue = qBlue(pixel);
+    const int r = lut.weight[red];
+    const int g = lut.weight[green];
+    const int b = lut.weight[blue];
+
+    // Ordered by which fraction is biggest
+    int w1, w2, w3;
+    if (r >= g) {
+        if (g >= b) {
+            *first = s_lutStrideRed;
+            *second = s_lutStrideRed + s_lutStrideGreen;
+            w1 = r; w2 = g; w3 = b;
+        } else if (r >= b) {
+            *first = s_lutStrideRed;
+            *second = s_lutStrideRed + s_lutStrideBlue;
+            w1 = r; w2 = b; w3 = g;
+        } else {
+            *first = s_lutStrideBlue;
+            *second = s_lutStrideBlue + s_lutStrideRed;
+            w1 = b; w2 = r; w3 = g;
+        }
+    } else {
+        if (r >= b) {
+            *first = s_lutStrideGreen;
+            *second = s_lutStrideGreen + s_lutStrideRed;
+            w1 = g; w2 = r; w3 = b;
+        } else if (g >= b) {
+            *first = s_lutStrideGreen;
+            *second = s_lutStrideGreen + s_lutStrideBlue;
+            w1 = g; w2 = b; w3 = r;
+        } else {
+            *first = s_lutStrideBlue;
+            *second = s_lutStrideBlue + s_lutStrideGreen;
+            w1 = b; w2 = g; w3 = r;
+        }
+    }
+    weights[0] = 256 - w1;
+    weights[1] = w1 - w2;
+    weights[2] = w2 - w3;
+    weights[3] = w3;
+
+    return lut.table.constData() +
+        lut.index[red] * s_lutStrideRed + lut.index[green] * s_lutStrideGreen + lut.index[blue] * s_lutStrideBlue;
+}
+
+static inline QRgb lutPixelScalar(const ColorLut &lut, QRgb pixel)
+{
+    int first, second, weights[4];
+    const qint16 *base = lutCorners(lut, pixel, &first, &second, weights);
+    const qint16 *last = base + s_lutStrideRed + s_lutStrideGreen + s_lutStrideBlue;
+
+    int channels[3];
+    for (int k = 0; k < 3; k++) {
+        const int sum = weights[0] * base[k] + weights[1] * base[first + k] +
+            weights[2] * base[second + k] + weights[3] * last[k];
+        channels[k] = (sum + (1 << 14)) >> 15;
+    }
+    return qRgba(channels[2], channels[1], channels[0], qAlpha(pixel));
+}
+
+// Neighbouring pixels are often the same, so the last one is remembered
+static void applyColorLutScalar(const ColorLut &lut, QRgb *pixels, int count)
+{
+    QRgb lastIn = 0;
+    QRgb lastOut = lutPixelScalar(lut, 0);
+    for (int i = 0; i < count; i++) {
+        if (pixels[i] != lastIn) {
+            lastIn = pixels[i];
+            lastOut = lutPixelScalar(lut, lastIn);
+        }
+        pixels[i] = lastOut;
+    }
+}
+
+#ifdef IMGEFFECTS_X86
+
+// All three channels at once, each corner pair in one _mm_madd_epi16()
+__attribute__((target("sse2")))
+static inline QRgb lutPixelSSE2(const ColorLut &lut, QRgb pixel)
+{
+    int first, second, weights[4];
+    const qint16 *base = lutCorners(lut, pixel, &first, &second, weights);
+    const qint16 *last = base + s_lutStrideRed + s_lutStrideGreen + s_lutStrideBlue;
+
+    const __m128i c0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(base));
+    const __m128i c1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(base + first));
+    const __m128i c2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(base + second));
+    const __m128i c3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(last));
+    const __m128i w01 = _mm_set1_epi32(weights[0] | (weights[1] << 16));
+    const __m128i w23 = _mm_set1_epi32(weights[2] | (weights[3] << 16));
+
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c0, c1), w01),
+                                _mm_madd_epi16(_mm_unpacklo_epi16(c2, c3), w23));
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << 14)), 15);
+    sum = _mm_packs_epi32(sum, sum);
+    sum = _mm_packus_epi16(sum, sum);
+
+    // Already in the byte order of QRgb
+    return (quint32(_mm_cvtsi128_si32(sum)) & 0xffffff) | (pixel & 0xff000000);
+}
+
+__attribute__((target("sse2")))
+static void applyColorLutSSE2(const ColorLut &lut, QRgb *pixels, int count)
+{
+    QRgb lastIn = 0;
+    QRgb lastOut = lutPixelSSE2(lut, 0);
+    for (int i = 0; i < count; i++) {
+        if (pixels[i] != lastIn) {
+            lastIn = pixels[i];
+            lastOut = lutPixelSSE2(lut, lastIn);
+        }
+        pixels[i] = lastOut;
+    }
+}
+
+#endif // IMGEFFECTS_X86
+
+static void applyColorLut(const ColorLut &lut, QRgb *pixels, int count)
+{
+    switch (effectsCpuLevel()) {
+#ifdef IMGEFFECTS_X86
+    // One pixel at a time, so AVX2 has nothing more to offer
+    case EffectsAVX2:
+    case EffectsSSE41:
+        applyColorLutSSE2(lut, pixels, count);
+        return;
+#endif
+    default:
+        applyColorLutScalar(lut, pixels, count);
+        return;
+    }
+}
+
+// The image has to be RGB32 or ARGB32
+static void applyColorLut(const ColorLut &lut, QImage *image)
+{
+    // Detach before the threads get to it
+    uchar *bits = image->bits();
+    const int bytesPerLine = image->bytesPerLine();
+    const int width = image->width();
+    parallelFor(image->height(), 16, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            applyColorLut(lut, reinterpret_cast<QRgb*>(bits + qint64(y) * bytesPerLine), width);
+        }
+    });
+}
+
+#endif // COLORLUT_H
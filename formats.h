@@ -0,0 +1,75 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+#include <QByteArray>
+
+#include <cstring>
+
+// How much of the start of the file sniffFormat() wants
+static const int s_sniffSize = 32;
+
+struct FormatMagic {
+    int offset;
+    const char *magic;
+    int length;
+    const char *format;
+};
+
+// Ordered so that more specific magics come before the ones they share a
+// prefix with. The format names are the QImageReader plugin keys.
+static const FormatMagic s_formatMagics[] = {
+    { 0, "\x89PNG\r\n\x1a\n", 8, "png" },
+    { 0, "\xff\xd8\xff", 3, "jpeg" },
+    { 0, "GIF87a", 6, "gif" },
+    { 0, "GIF89a", 6, "gif" },
+    { 8, "WEBP", 4, "webp" },
+    { 8, "ACON", 4, "ani" },
+    { 0, "\x8aMNG\r\n\x1a\n", 8, "mng" },
+    { 0, "II*\0", 4, "tiff" },
+    { 0, "MM\0*", 4, "tiff" },
+    { 0, "BM", 2, "bmp" },
+    { 0, "\0\0\1\0", 4, "ico" },
+    { 0, "\0\0\2\0", 4, "cur" },
+    { 0, "8BPS", 4, "psd" },
+    { 0, "gimp xcf", 8, "xcf" },
+    { 0, "DDS ", 4, "dds" },
+    { 0, "icns", 4, "icns" },
+    { 0, "qoif", 4, "qoi" },
+    { 0, "v/1\x01", 4, "exr" },
+    { 0, "#?RADIANCE", 10, "hdr" },
+    { 0, "#?RGBE", 6, "hdr" },
+    { 0, "\xff\x0a", 2, "jxl" },
+    { 0, "\0\0\0\x0cJXL \r\n\x87\n", 12, "jxl" },
+    { 0, "\0\0\0\x0cjP  \r\n\x87\n", 12, "jp2" },
+    { 8, "avif", 4, "avif" },
+    { 8, "avis", 4, "avif" },
+    { 8, "heic", 4, "heif" },
+    { 8, "heix", 4, "heif" },
+    { 0, "\x59\xa6\x6a\x95", 4, "ras" },
+    { 0, "\x01\xda", 2, "rgb" },
+    { 0, "/* XPM */", 9, "xpm" },
+    { 0, "P1", 2, "pbm" },
+    { 0, "P4", 2, "pbm" },
+    { 0, "P2", 2, "pgm" },
+    { 0, "P5", 2, "pgm" },
+    { 0, "P3", 2, "ppm" },
+    { 0, "P6", 2, "ppm" },
+};
+
+// Guesses the format from the first bytes of the file, so we can tell
+// QImageReader which plugin to use instead of letting it ask all of them.
+// Returns an empty string if we don't know it.
+static QByteArray sniffFormat(const QByteArray &header)
+{
+    for (const FormatMagic &entry : s_formatMagics) {
+        if (header.size() < entry.offset + entry.length) {
+            continue;
+        }
+        if (memcmp(header.constData() + entry.offset, entry.magic, entry.length) == 0) {
+            return entry.format;
+        }
+    }
+    return QByteArray();
+}
+
+#endif // FORMATS_H
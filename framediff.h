@@ -0,0 +1,171 @@
+#ifndef FRAMEDIFF_H
+#define FRAMEDIFF_H
+
+#include "imgeffects.h"
+
+#include <QImage>
+#include <QRect>
+
+#include <string.h>
+
+// Finds the rectangle where two frames of an animation differ, so only that
+// part of the window has to be repainted. Most animations (especially screen
+// recordings) only change a small part of each frame.
+
+// Index of the first pixel that differs, or count if none do
+static int firstDifferenceScalar(const quint32 *a, const quint32 *b, int count)
+{
+    int i = 0;
+    while (i < count && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// Index of the last pixel that differs, or -1 if none do
+static int lastDifferenceScalar(const quint32 *a, const quint32 *b, int count)
+{
+    int i = count - 1;
+    while (i >= 0 && a[i] == b[i]) {
+        i--;
+    }
+    return i;
+}
+
+#ifdef IMGEFFECTS_X86
+
+__attribute__((target("sse2")))
+static int firstDifferenceSSE2(const quint32 *a, const quint32 *b, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i pa = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i pb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(pa, pb)) != 0xffff) {
+            break;
+        }
+    }
+    return i + firstDifferenceScalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static int lastDifferenceSSE2(const quint32 *a, const quint32 *b, int count)
+{
+    int end = count;
+    for (; end >= 4; end -= 4) {
+        const __m128i pa = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + end - 4));
+        const __m128i pb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + end - 4));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(pa, pb)) != 0xffff) {
+            break;
+        }
+    }
+    return lastDifferenceScalar(a, b, end);
+}
+
+__attribute__((target("avx2")))
+static int firstDifferenceAVX2(const quint32 *a, const quint32 *b, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i pa = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i pb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(pa, pb)) != -1) {
+            break;
+        }
+    }
+    return i + firstDifferenceScalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static int lastDifferenceAVX2(const quint32 *a, const quint32 *b, int count)
+{
+    int end = count;
+    for (; end >= 8; end -= 8) {
+        const __m256i pa = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + end - 8));
+        const __m256i pb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + end - 8));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(pa, pb)) != -1) {
+            break;
+        }
+    }
+    return lastDifferenceScalar(a, b, end);
+}
+
+#endif // IMGEFFECTS_X86
+
+static int firstDifference(const quint32 *a, const quint32 *b, int count)
+{
+    switch (effectsCpuLevel()) {
+#ifdef IMGEFFECTS_X86
+    case EffectsAVX2:
+        return firstDifferenceAVX2(a, b, count);
+    case EffectsSSE41:
+        return firstDifferenceSSE2(a, b, count);
+#endif
+    default:
+        return firstDifferenceScalar(a, b, count);
+    }
+}
+
+static int lastDifference(const quint32 *a, const quint32 *b, int count)
+{
+    switch (effectsCpuLevel()) {
+#ifdef IMGEFFECTS_X86
+    case EffectsAVX2:
+        return lastDifferenceAVX2(a, b, count);
+    case EffectsSSE41:
+        return lastDifferenceSSE2(a, b, count);
+#endif
+    default:
+        return lastDifferenceScalar(a, b, count);
+    }
+}
+
+// Empty if they are the same, the whole frame if they can't be compared
+static QRect changedRect(const QImage &previous, const QImage &current)
+{
+    const int width = current.width();
+    const int height = current.height();
+    if (previous.size() != current.size() || previous.format() != current.format()) {
+        return current.rect();
+    }
+    if (previous.cacheKey() == current.cacheKey()) {
+        return QRect();
+    }
+
+    // Whole rows first, memcmp() is already vectorized
+    const int rowBytes = (width * current.depth() + 7) / 8;
+    int top = 0;
+    while (top < height && !memcmp(previous.constScanLine(top), current.constScanLine(top), rowBytes)) {
+        top++;
+    }
+    if (top == height) {
+        return QRect();
+    }
+    int bottom = height - 1;
+    while (bottom > top && !memcmp(previous.constScanLine(bottom), current.constScanLine(bottom), rowBytes)) {
+        bottom--;
+    }
+    if (current.depth() != 32) {
+        return QRect(0, top, width, bottom - top + 1);
+    }
+
+    // Each row only needs to be searched outside of what we already found
+    int left = width;
+    int right = -1;
+    for (int y = top; y <= bottom && (left > 0 || right < width - 1); y++) {
+        const quint32 *a = reinterpret_cast<const quint32*>(previous.constScanLine(y));
+        const quint32 *b = reinterpret_cast<const quint32*>(current.constScanLine(y));
+        left = firstDifference(a, b, left);
+        const int start = right + 1;
+        const int last = lastDifference(a + start, b + start, width - start);
+        if (last >= 0) {
+            right = start + last;
+        }
+    }
+    if (right < left) {
+        return QRect(0, top, width, bottom - top + 1);
+    }
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+#endif // FRAMEDIFF_H
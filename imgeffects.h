@@ -26,7 +26,10 @@
 #ifndef IMGEFFECTS_H
 #define IMGEFFECTS_H
 
+#include "parallel.h"
+
 #include <QImage>
+#include <QMutex>
 
 inline QRgb convertFromPremult(QRgb p)
 {
@@ -51,6 +54,407 @@ inline QRgb convertToPremult(QRgb p)
     return(p);
 }
 
+// Vectorized kernels for the histogram and writing passes, picked at runtime
+// depending on what the CPU supports. They give exactly the same results as
+// going through convertFromPremult()/convertToPremult() one pixel at a time.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMGEFFECTS_X86
+#include <immintrin.h>
+#endif
+
+enum EffectsCpuLevel {
+    EffectsScalar,
+    EffectsSSE41,
+    EffectsAVX2
+};
+
+static EffectsCpuLevel effectsCpuLevel()
+{
+#ifdef IMGEFFECTS_X86
+    static const EffectsCpuLevel level =
+        __builtin_cpu_supports("avx2") ? EffectsAVX2 :
+        __builtin_cpu_supports("sse4.1") ? EffectsSSE41 :
+        EffectsScalar;
+    return level;
+#else
+    return EffectsScalar;
+#endif
+}
+
+// Number of pixels unpremultiplied into a temporary buffer at a time
+static const int s_effectsBlockSize = 256;
+
+// Uses four sub-histograms so consecutive pixels with the same value don't
+// stall on incrementing the same counter. They are kept by the caller for a
+// whole band, and added up with mergeHistograms() once at the end.
+static void countHistogram(const QRgb *pixels, int count, quint32 sub[4][3][256])
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4){
+        for(int k = 0; k < 4; ++k){
+            const QRgb pixel = pixels[i + k];
+            sub[k][0][qRed(pixel)]++;
+            sub[k][1][qGreen(pixel)]++;
+            sub[k][2][qBlue(pixel)]++;
+        }
+    }
+    for(; i < count; ++i){
+        const QRgb pixel = pixels[i];
+        sub[0][0][qRed(pixel)]++;
+        sub[0][1][qGreen(pixel)]++;
+        sub[0][2][qBlue(pixel)]++;
+    }
+}
+
+static void mergeHistograms(const quint32 sub[4][3][256], quint32 histogram[3][256])
+{
+    for(int c = 0; c < 3; ++c){
+        for(int v = 0; v < 256; ++v){
+            histogram[c][v] += sub[0][c][v] + sub[1][c][v] + sub[2][c][v] + sub[3][c][v];
+        }
+    }
+}
+
+static inline QRgb lookupPixel(QRgb pixel, const quint8 lut[3][256])
+{
+    return qRgba(lut[0][qRed(pixel)], lut[1][qGreen(pixel)], lut[2][qBlue(pixel)], qAlpha(pixel));
+}
+
+static void histogramScalar(const QRgb *pixels, int count, bool premultiplied, quint32 sub[4][3][256])
+{
+    if(!premultiplied){
+        countHistogram(pixels, count, sub);
+        return;
+    }
+    QRgb buffer[s_effectsBlockSize];
+    for(int i = 0; i < count; i += s_effectsBlockSize){
+        const int blockSize = qMin(s_effectsBlockSize, count - i);
+        for(int k = 0; k < blockSize; ++k){
+            buffer[k] = convertFromPremult(pixels[i + k]);
+        }
+        countHistogram(buffer, blockSize, sub);
+    }
+}
+
+static void applyLutScalar(QRgb *pixels, int count, bool premultiplied, const quint8 lut[3][256])
+{
+    if(premultiplied){
+        for(int i = 0; i < count; ++i){
+            pixels[i] = convertToPremult(lookupPixel(convertFromPremult(pixels[i]), lut));
+        }
+    }
+    else{
+        for(int i = 0; i < count; ++i){
+            pixels[i] = lookupPixel(pixels[i], lut);
+        }
+    }
+}
+
+#ifdef IMGEFFECTS_X86
+
+// 255 * c / alpha is exact when done in single precision floats, the
+// quotient is never close enough to an integer for the rounding to matter.
+__attribute__((target("sse4.1")))
+static inline __m128i unpremultiplySSE41(__m128i p)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i alpha = _mm_srli_epi32(p, 24);
+    const __m128 alphaF = _mm_cvtepi32_ps(alpha);
+    const __m128 max = _mm_set1_ps(255.f);
+
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+    __m128i b = _mm_and_si128(p, mask);
+    r = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(r), max), alphaF));
+    g = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(g), max), alphaF));
+    b = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(b), max), alphaF));
+
+    __m128i result = _mm_slli_epi32(alpha, 24);
+    result = _mm_or_si128(result, _mm_slli_epi32(_mm_and_si128(r, mask), 16));
+    result = _mm_or_si128(result, _mm_slli_epi32(_mm_and_si128(g, mask), 8));
+    result = _mm_or_si128(result, _mm_and_si128(b, mask));
+
+    // Fully transparent becomes 0, like convertFromPremult()
+    const __m128i transparent = _mm_cmpeq_epi32(alpha, _mm_setzero_si128());
+    return _mm_blendv_epi8(result, _mm_setzero_si128(), transparent);
+}
+
+// Same as convertToPremult(), but with two channels per 32 bit lane in
+// 16 bit lanes, none of the intermediate values overflow 16 bits.
+__attribute__((target("sse4.1")))
+static inline __m128i premultiplySSE41(__m128i p)
+{
+    const __m128i alpha = _mm_srli_epi32(p, 24);
+    const __m128i alpha16 = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+    const __m128i half = _mm_set1_epi16(0x80);
+
+    __m128i rb = _mm_mullo_epi16(_mm_and_si128(p, _mm_set1_epi32(0xff00ff)), alpha16);
+    rb = _mm_add_epi16(rb, _mm_add_epi16(_mm_srli_epi16(rb, 8), half));
+    rb = _mm_srli_epi16(rb, 8);
+
+    __m128i g = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xff)), alpha16);
+    g = _mm_add_epi16(g, _mm_add_epi16(_mm_srli_epi16(g, 8), half));
+    g = _mm_and_si128(g, _mm_set1_epi32(0xff00));
+
+    return _mm_or_si128(_mm_or_si128(rb, g), _mm_slli_epi32(alpha, 24));
+}
+
+__attribute__((target("sse4.1")))
+static int unpremultiplyBlockSSE41(const QRgb *src, QRgb *dest, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4){
+        const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), unpremultiplySSE41(p));
+    }
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static void histogramSSE41(const QRgb *pixels, int count, bool premultiplied, quint32 sub[4][3][256])
+{
+    if(!premultiplied){
+        countHistogram(pixels, count, sub);
+        return;
+    }
+    QRgb buffer[s_effectsBlockSize];
+    for(int i = 0; i < count; i += s_effectsBlockSize){
+        const int blockSize = qMin(s_effectsBlockSize, count - i);
+        for(int k = unpremultiplyBlockSSE41(pixels + i, buffer, blockSize); k < blockSize; ++k){
+            buffer[k] = convertFromPremult(pixels[i + k]);
+        }
+        countHistogram(buffer, blockSize, sub);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void applyLutSSE41(QRgb *pixels, int count, bool premultiplied, const quint8 lut[3][256])
+{
+    if(!premultiplied){
+        applyLutScalar(pixels, count, false, lut);
+        return;
+    }
+    QRgb buffer[s_effectsBlockSize];
+    for(int i = 0; i < count; i += s_effectsBlockSize){
+        const int blockSize = qMin(s_effectsBlockSize, count - i);
+        QRgb *dest = pixels + i;
+        for(int k = unpremultiplyBlockSSE41(dest, buffer, blockSize); k < blockSize; ++k){
+            buffer[k] = convertFromPremult(dest[k]);
+        }
+        for(int k = 0; k < blockSize; ++k){
+            buffer[k] = lookupPixel(buffer[k], lut);
+        }
+        int k = 0;
+        for(; k + 4 <= blockSize; k += 4){
+            const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + k));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + k), premultiplySSE41(p));
+        }
+        for(; k < blockSize; ++k){
+            dest[k] = convertToPremult(buffer[k]);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i unpremultiplyAVX2(__m256i p)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i alpha = _mm256_srli_epi32(p, 24);
+    const __m256 alphaF = _mm256_cvtepi32_ps(alpha);
+    const __m256 max = _mm256_set1_ps(255.f);
+
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+    __m256i b = _mm256_and_si256(p, mask);
+    r = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(r), max), alphaF));
+    g = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(g), max), alphaF));
+    b = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(b), max), alphaF));
+
+    __m256i result = _mm256_slli_epi32(alpha, 24);
+    result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_and_si256(r, mask), 16));
+    result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_and_si256(g, mask), 8));
+    result = _mm256_or_si256(result, _mm256_and_si256(b, mask));
+
+    const __m256i transparent = _mm256_cmpeq_epi32(alpha, _mm256_setzero_si256());
+    return _mm256_blendv_epi8(result, _mm256_setzero_si256(), transparent);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premultiplyAVX2(__m256i p)
+{
+    const __m256i alpha = _mm256_srli_epi32(p, 24);
+    const __m256i alpha16 = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+    const __m256i half = _mm256_set1_epi16(0x80);
+
+    __m256i rb = _mm256_mullo_epi16(_mm256_and_si256(p, _mm256_set1_epi32(0xff00ff)), alpha16);
+    rb = _mm256_add_epi16(rb, _mm256_add_epi16(_mm256_srli_epi16(rb, 8), half));
+    rb = _mm256_srli_epi16(rb, 8);
+
+    __m256i g = _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xff)), alpha16);
+    g = _mm256_add_epi16(g, _mm256_add_epi16(_mm256_srli_epi16(g, 8), half));
+    g = _mm256_and_si256(g, _mm256_set1_epi32(0xff00));
+
+    return _mm256_or_si256(_mm256_or_si256(rb, g), _mm256_slli_epi32(alpha, 24));
+}
+
+// The lookup tables are widened and shifted into place, so gathering from
+// them gives the channels ready to be or'ed together.
+struct WideLut
+{
+    quint32 red[256], green[256], blue[256];
+
+    explicit WideLut(const quint8 lut[3][256]) {
+        for(int i = 0; i < 256; ++i){
+            red[i] = quint32(lut[0][i]) << 16;
+            green[i] = quint32(lut[1][i]) << 8;
+            blue[i] = lut[2][i];
+        }
+    }
+};
+
+__attribute__((target("avx2")))
+static inline __m256i lookupAVX2(__m256i p, const WideLut &lut)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i r = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut.red),
+                                             _mm256_and_si256(_mm256_srli_epi32(p, 16), mask), 4);
+    const __m256i g = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut.green),
+                                             _mm256_and_si256(_mm256_srli_epi32(p, 8), mask), 4);
+    const __m256i b = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut.blue),
+                                             _mm256_and_si256(p, mask), 4);
+    const __m256i alpha = _mm256_and_si256(p, _mm256_set1_epi32(0xff000000));
+    return _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, alpha));
+}
+
+__attribute__((target("avx2")))
+static void histogramAVX2(const QRgb *pixels, int count, bool premultiplied, quint32 sub[4][3][256])
+{
+    if(!premultiplied){
+        countHistogram(pixels, count, sub);
+        return;
+    }
+    QRgb buffer[s_effectsBlockSize];
+    for(int i = 0; i < count; i += s_effectsBlockSize){
+        const int blockSize = qMin(s_effectsBlockSize, count - i);
+        int k = 0;
+        for(; k + 8 <= blockSize; k += 8){
+            const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i + k));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(buffer + k), unpremultiplyAVX2(p));
+        }
+        for(; k < blockSize; ++k){
+            buffer[k] = convertFromPremult(pixels[i + k]);
+        }
+        countHistogram(buffer, blockSize, sub);
+    }
+}
+
+__attribute__((target("avx2")))
+static void applyLutAVX2(QRgb *pixels, int count, bool premultiplied, const quint8 lut[3][256])
+{
+    const WideLut wideLut(lut);
+    int i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+        if(premultiplied){
+            p = premultiplyAVX2(lookupAVX2(unpremultiplyAVX2(p), wideLut));
+        }
+        else{
+            p = lookupAVX2(p, wideLut);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + i), p);
+    }
+    applyLutScalar(pixels + i, count - i, premultiplied, lut);
+}
+
+#endif // IMGEFFECTS_X86
+
+// Adds the unpremultiplied red, green and blue values of the pixels to the
+// sub-histograms of countHistogram().
+static void effectsHistogram(const QRgb *pixels, int count, bool premultiplied, quint32 sub[4][3][256])
+{
+    switch(effectsCpuLevel()){
+#ifdef IMGEFFECTS_X86
+    case EffectsAVX2:
+        histogramAVX2(pixels, count, premultiplied, sub);
+        return;
+    case EffectsSSE41:
+        histogramSSE41(pixels, count, premultiplied, sub);
+        return;
+#endif
+    default:
+        histogramScalar(pixels, count, premultiplied, sub);
+        return;
+    }
+}
+
+// Maps the unpremultiplied red, green and blue values through the lookup
+// tables, alpha is kept as is.
+static void effectsApplyLut(QRgb *pixels, int count, bool premultiplied, const quint8 lut[3][256])
+{
+    switch(effectsCpuLevel()){
+#ifdef IMGEFFECTS_X86
+    case EffectsAVX2:
+        applyLutAVX2(pixels, count, premultiplied, lut);
+        return;
+    case EffectsSSE41:
+        applyLutSSE41(pixels, count, premultiplied, lut);
+        return;
+#endif
+    default:
+        applyLutScalar(pixels, count, premultiplied, lut);
+        return;
+    }
+}
+
+// Rows in each band are at least this many pixels, smaller isn't worth
+// the overhead of spreading out over the threads.
+static const int s_effectsMinBandPixels = 64 * 1024;
+
+// Counts bands of rows in separate histograms on the thread pool, and adds
+// them up afterwards.
+static void parallelHistogram(const QImage &img, bool premultiplied, quint32 histogram[3][256])
+{
+    const uchar *bits = img.constBits();
+    const int bytesPerLine = img.bytesPerLine();
+    const int width = img.width();
+    QMutex mutex;
+
+    parallelFor(img.height(), qMax(1, s_effectsMinBandPixels / width), [&](int begin, int end) {
+        quint32 band[4][3][256];
+        memset(band, 0, sizeof(band));
+        if(bytesPerLine == width * int(sizeof(QRgb))){
+            effectsHistogram(reinterpret_cast<const QRgb *>(bits + qint64(begin) * bytesPerLine), (end - begin) * width, premultiplied, band);
+        }
+        else{
+            for(int y = begin; y < end; ++y){
+                effectsHistogram(reinterpret_cast<const QRgb *>(bits + qint64(y) * bytesPerLine), width, premultiplied, band);
+            }
+        }
+
+        QMutexLocker locker(&mutex);
+        mergeHistograms(band, histogram);
+    });
+}
+
+static void parallelApplyLut(QImage &img, bool premultiplied, const quint8 lut[3][256])
+{
+    uchar *bits = img.bits();
+    const int bytesPerLine = img.bytesPerLine();
+    const int width = img.width();
+
+    parallelFor(img.height(), qMax(1, s_effectsMinBandPixels / width), [&](int begin, int end) {
+        if(bytesPerLine == width * int(sizeof(QRgb))){
+            effectsApplyLut(reinterpret_cast<QRgb *>(bits + qint64(begin) * bytesPerLine), (end - begin) * width, premultiplied, lut);
+        }
+        else{
+            for(int y = begin; y < end; ++y){
+                effectsApplyLut(reinterpret_cast<QRgb *>(bits + qint64(y) * bytesPerLine), width, premultiplied, lut);
+            }
+        }
+    });
+}
+
 // These are used as accumulators
 
 typedef struct
@@ -87,8 +491,9 @@ static bool normalize(QImage &img)
 
     uint threshold_intensity;
     int i, count;
-    QRgb pixel, *dest;
-    unsigned char r, g, b;
+    bool premultiplied;
+    quint32 counts[3][256];
+    quint8 lut[3][256];
 
     if(img.depth() < 32){
         img = img.convertToFormat(img.hasAlphaChannel() ?
@@ -96,31 +501,19 @@ static bool normalize(QImage &img)
                                   QImage::Format_RGB32);
     }
     count = img.width()*img.height();
+    premultiplied = img.format() == QImage::Format_ARGB32_Premultiplied;
 
     histogram = new HistogramListItem[256];
     normalize_map = new CharPixel[256];
 
-    // form histogram
+    // form histogram, alpha isn't used so it isn't counted
     memset(histogram, 0, 256*sizeof(HistogramListItem));
-    dest = (QRgb *)img.bits();
-
-    if(img.format() == QImage::Format_ARGB32_Premultiplied){
-        for(i=0; i < count; ++i, ++dest){
-            pixel = convertFromPremult(*dest);
-            histogram[qRed(pixel)].red++;
-            histogram[qGreen(pixel)].green++;
-            histogram[qBlue(pixel)].blue++;
-            histogram[qAlpha(pixel)].alpha++;
-        }
-    }
-    else{
-        for(i=0; i < count; ++i){
-            pixel = *dest++;
-            histogram[qRed(pixel)].red++;
-            histogram[qGreen(pixel)].green++;
-            histogram[qBlue(pixel)].blue++;
-            histogram[qAlpha(pixel)].alpha++;
-        }
+    memset(counts, 0, sizeof(counts));
+    parallelHistogram(img, premultiplied, counts);
+    for(i=0; i < 256; ++i){
+        histogram[i].red = counts[0][i];
+        histogram[i].green = counts[1][i];
+        histogram[i].blue = counts[2][i];
     }
 
     // find the histogram boundaries by locating the .01 percent levels.
@@ -200,31 +593,12 @@ static bool normalize(QImage &img)
     }
 
     // write
-    dest = (QRgb *)img.bits();
-    if(img.format() == QImage::Format_ARGB32_Premultiplied){
-        for(i=0; i < count; ++i, ++dest){
-            pixel = convertFromPremult(*dest);
-            r = (low.red != high.red) ? normalize_map[qRed(pixel)].red :
-                qRed(pixel);
-            g = (low.green != high.green) ? normalize_map[qGreen(pixel)].green :
-                qGreen(pixel);
-            b = (low.blue != high.blue) ?  normalize_map[qBlue(pixel)].blue :
-                qBlue(pixel);
-            *dest = convertToPremult(qRgba(r, g, b, qAlpha(pixel)));
-        }
-    }
-    else{
-        for(i=0; i < count; ++i){
-            pixel = *dest;
-            r = (low.red != high.red) ? normalize_map[qRed(pixel)].red :
-                qRed(pixel);
-            g = (low.green != high.green) ? normalize_map[qGreen(pixel)].green :
-                qGreen(pixel);
-            b = (low.blue != high.blue) ?  normalize_map[qBlue(pixel)].blue :
-                qBlue(pixel);
-            *dest++ = qRgba(r, g, b, qAlpha(pixel));
-        }
+    for(i=0; i < 256; ++i){
+        lut[0][i] = (low.red != high.red) ? normalize_map[i].red : i;
+        lut[1][i] = (low.green != high.green) ? normalize_map[i].green : i;
+        lut[2][i] = (low.blue != high.blue) ? normalize_map[i].blue : i;
     }
+    parallelApplyLut(img, premultiplied, lut);
 
     delete[] normalize_map;
     return(true);
@@ -239,42 +613,30 @@ static bool equalize(QImage &img)
     IntegerPixel *map;
     IntegerPixel intensity, high, low;
     CharPixel *equalize_map;
-    int i, count;
-    QRgb pixel, *dest;
-    unsigned char r, g, b;
+    int i;
+    bool premultiplied;
+    quint32 counts[3][256];
+    quint8 lut[3][256];
 
     if(img.depth() < 32){
         img = img.convertToFormat(img.hasAlphaChannel() ?
                                   QImage::Format_ARGB32 :
                                   QImage::Format_RGB32);
     }
-    count = img.width()*img.height();
+    premultiplied = img.format() == QImage::Format_ARGB32_Premultiplied;
 
     map = new IntegerPixel[256];
     histogram = new HistogramListItem[256];
     equalize_map = new CharPixel[256];
 
-    // form histogram
+    // form histogram, alpha isn't used so it isn't counted
     memset(histogram, 0, 256*sizeof(HistogramListItem));
-    dest = (QRgb *)img.bits();
-
-    if(img.format() == QImage::Format_ARGB32_Premultiplied){
-        for(i=0; i < count; ++i, ++dest){
-            pixel = convertFromPremult(*dest);
-            histogram[qRed(pixel)].red++;
-            histogram[qGreen(pixel)].green++;
-            histogram[qBlue(pixel)].blue++;
-            histogram[qAlpha(pixel)].alpha++;
-        }
-    }
-    else{
-        for(i=0; i < count; ++i){
-            pixel = *dest++;
-            histogram[qRed(pixel)].red++;
-            histogram[qGreen(pixel)].green++;
-            histogram[qBlue(pixel)].blue++;
-            histogram[qAlpha(pixel)].alpha++;
-        }
+    memset(counts, 0, sizeof(counts));
+    parallelHistogram(img, premultiplied, counts);
+    for(i=0; i < 256; ++i){
+        histogram[i].red = counts[0][i];
+        histogram[i].green = counts[1][i];
+        histogram[i].blue = counts[2][i];
     }
 
     // integrate the histogram to get the equalization map
@@ -302,31 +664,12 @@ static bool equalize(QImage &img)
     }
 
     // stretch the histogram and write
-    dest = (QRgb *)img.bits();
-    if(img.format() == QImage::Format_ARGB32_Premultiplied){
-        for(i=0; i < count; ++i, ++dest){
-            pixel = convertFromPremult(*dest);
-            r = (low.red != high.red) ? equalize_map[qRed(pixel)].red :
-                qRed(pixel);
-            g = (low.green != high.green) ? equalize_map[qGreen(pixel)].green :
-                qGreen(pixel);
-            b = (low.blue != high.blue) ?  equalize_map[qBlue(pixel)].blue :
-                qBlue(pixel);
-            *dest = convertToPremult(qRgba(r, g, b, qAlpha(pixel)));
-        }
-    }
-    else{
-        for(i=0; i < count; ++i){
-            pixel = *dest;
-            r = (low.red != high.red) ? equalize_map[qRed(pixel)].red :
-                qRed(pixel);
-            g = (low.green != high.green) ? equalize_map[qGreen(pixel)].green :
-                qGreen(pixel);
-            b = (low.blue != high.blue) ?  equalize_map[qBlue(pixel)].blue :
-                qBlue(pixel);
-            *dest++ = qRgba(r, g, b, qAlpha(pixel));
-        }
+    for(i=0; i < 256; ++i){
+        lut[0][i] = (low.red != high.red) ? equalize_map[i].red : i;
+        lut[1][i] = (low.green != high.green) ? equalize_map[i].green : i;
+        lut[2][i] = (low.blue != high.blue) ? equalize_map[i].blue : i;
     }
+    parallelApplyLut(img, premultiplied, lut);
 
     delete[] histogram;
     delete[] map;
@@ -0,0 +1,146 @@
+#ifndef MAGNIFY_H
+#define MAGNIFY_H
+
+#include "imgeffects.h"
+#include "parallel.h"
+
+#include <QImage>
+
+// Nearest neighbour magnification by whole numbers, for looking at single
+// pixels. Every source pixel becomes a run of zoom pixels in a row, and the
+// row is then copied zoom times.
+
+static inline void fillPixelsScalar(QRgb *dest, QRgb value, int count)
+{
+    for (int i = 0; i < count; i++) {
+        dest[i] = value;
+    }
+}
+
+static void magnifyRowScalar(const QRgb *source, int zoom, int phase, QRgb *dest, int count)
+{
+    int x = 0;
+    for (int i = 0; x < count; i++) {
+        const int run = qMin(i ? zoom : zoom - phase, count - x);
+        fillPixelsScalar(dest + x, source[i], run);
+        x += run;
+    }
+}
+
+#ifdef IMGEFFECTS_X86
+
+__attribute__((target("sse2")))
+static void magnifyRowSSE2(const QRgb *source, int zoom, int phase, QRgb *dest, int count)
+{
+    int x = 0;
+    int i = 0;
+    // The partial pixel at the start
+    if (phase) {
+        const int run = qMin(zoom - phase, count);
+        fillPixelsScalar(dest, source[0], run);
+        x += run;
+        i++;
+    }
+
+    if (zoom == 2) {
+        // Four pixels in, eight out
+        for (; x + 8 <= count; x += 8, i += 4) {
+            const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), _mm_unpacklo_epi32(p, p));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x + 4), _mm_unpackhi_epi32(p, p));
+        }
+    } else if (zoom >= 4) {
+        for (; x + zoom <= count; x += zoom, i++) {
+            const __m128i p = _mm_set1_epi32(source[i]);
+            int k = 0;
+            for (; k + 4 <= zoom; k += 4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x + k), p);
+            }
+            fillPixelsScalar(dest + x + k, source[i], zoom - k);
+        }
+    }
+    magnifyRowScalar(source + i, zoom, 0, dest + x, count - x);
+}
+
+__attribute__((target("avx2")))
+static void magnifyRowAVX2(const QRgb *source, int zoom, int phase, QRgb *dest, int count)
+{
+    if (zoom < 8) {
+        magnifyRowSSE2(source, zoom, phase, dest, count);
+        return;
+    }
+    int x = 0;
+    int i = 0;
+    if (phase) {
+        const int run = qMin(zoom - phase, count);
+        fillPixelsScalar(dest, source[0], run);
+        x += run;
+        i++;
+    }
+    for (; x + zoom <= count; x += zoom, i++) {
+        const __m256i p = _mm256_set1_epi32(source[i]);
+        int k = 0;
+        for (; k + 8 <= zoom; k += 8) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x + k), p);
+        }
+        fillPixelsScalar(dest + x + k, source[i], zoom - k);
+    }
+    magnifyRowScalar(source + i, zoom, 0, dest + x, count - x);
+}
+
+#endif // IMGEFFECTS_X86
+
+// Writes count pixels, starting phase pixels into the run of source[0]
+static void magnifyRow(const QRgb *source, int zoom, int phase, QRgb *dest, int count)
+{
+    if (zoom == 1) {
+        memcpy(dest, source, count * sizeof(QRgb));
+        return;
+    }
+    switch (effectsCpuLevel()) {
+#ifdef IMGEFFECTS_X86
+    case EffectsAVX2:
+        magnifyRowAVX2(source, zoom, phase, dest, count);
+        return;
+    case EffectsSSE41:
+        magnifyRowSSE2(source, zoom, phase, dest, count);
+        return;
+#endif
+    default:
+        magnifyRowScalar(source, zoom, phase, dest, count);
+        return;
+    }
+}
+
+// Fills target with the part of source magnified zoom times that starts at
+// offset, in magnified pixels. Both need to be 32 bit, and the target has to
+// fit inside the magnified source.
+static void magnifyNearest(const QImage &source, const QPoint &offset, int zoom, QImage *target)
+{
+    const int width = target->width();
+    const int height = target->height();
+    // Detach before the threads get to it
+    uchar *bits = target->bits();
+    const int bytesPerLine = target->bytesPerLine();
+    const int phaseX = offset.x() % zoom;
+    const int firstColumn = offset.x() / zoom;
+
+    // In bands of source rows, so each is only magnified once
+    const int firstRow = offset.y() / zoom;
+    const int lastRow = (offset.y() + height - 1) / zoom;
+    parallelFor(lastRow - firstRow + 1, 16, [&](int begin, int end) {
+        for (int row = firstRow + begin; row < firstRow + end; row++) {
+            const int top = qMax(row * zoom - offset.y(), 0);
+            const int bottom = qMin((row + 1) * zoom - offset.y(), height);
+
+            const QRgb *sourceLine = reinterpret_cast<const QRgb*>(source.constScanLine(row)) + firstColumn;
+            uchar *first = bits + qint64(top) * bytesPerLine;
+            magnifyRow(sourceLine, zoom, phaseX, reinterpret_cast<QRgb*>(first), width);
+            for (int y = top + 1; y < bottom; y++) {
+                memcpy(bits + qint64(y) * bytesPerLine, first, width * sizeof(QRgb));
+            }
+        }
+    });
+}
+
+#endif // MAGNIFY_H
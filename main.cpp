@@ -1,13 +1,19 @@
 #include "Viewer.h"
+#include "Profiler.h"
+#include "Daemon.h"
 
 #include <QGuiApplication>
 #include <QDebug>
 #include <QImageReader>
 #include <QFileInfo>
+#include <QDir>
 #include <QMimeDatabase>
 #include <QAccessible>
 #include <QTimer>
 #include <QSurfaceFormat>
+#include <QSet>
+
+#include <unistd.h>
 
 //#define DEBUG_LAUNCH_TIME
 
@@ -18,11 +24,88 @@
 
 void dummyAccessibilityRootHandler(QObject*) {  }
 
+static QStringList imagesInDirectory(const QString &path)
+{
+    QStringList filters;
+    for (const QByteArray &format : QImageReader::supportedImageFormats()) {
+        filters.append("*." + QString::fromLatin1(format));
+    }
+    const QDir dir(path);
+    QStringList files;
+    for (const QString &name : dir.entryList(filters, QDir::Files | QDir::Readable, QDir::Name)) {
+        files.append(dir.filePath(name));
+    }
+    return files;
+}
+
+struct Options {
+    QStringList files;
+    int startFrame = -1;
+    bool cache = false;
+    bool colorManage = false;
+    bool daemon = false;
+    bool help = false;
+};
+
+// Relative paths are resolved against workingDirectory, if it is set
+static bool parseArguments(const QStringList &arguments, const QString &workingDirectory, Options *options)
+{
+    for (const QString &arg : arguments) {
+        if (arg == "-h" || arg == "-v" || arg == "--help" || arg == "--version") {
+            options->help = true;
+            return false;
+        }
+        if (arg.startsWith("--frame=")) {
+            bool ok = false;
+            options->startFrame = arg.section(QLatin1Char('='), 1).toInt(&ok);
+            if (!ok || options->startFrame < 0) {
+                return false;
+            }
+            continue;
+        }
+        if (arg == "--cache") {
+            options->cache = true;
+            continue;
+        }
+        if (arg == "--color-manage") {
+            options->colorManage = true;
+            continue;
+        }
+        if (arg == "--daemon") {
+            options->daemon = true;
+            continue;
+        }
+        if (arg.startsWith("--profile=")) {
+            continue;
+        }
+        QString path = arg;
+        if (!workingDirectory.isEmpty() && arg != "-") {
+            path = QDir(workingDirectory).absoluteFilePath(arg);
+        }
+        if (QFileInfo(path).isDir()) {
+            options->files.append(imagesInDirectory(path));
+        } else {
+            options->files.append(path);
+        }
+    }
+    if (options->daemon) {
+        return options->files.isEmpty();
+    }
+    return !options->files.isEmpty() && (options->files.count() == 1 || !options->files.contains("-"));
+}
+
 static void printHelp(const char *app, bool verbose)
 {
-    qDebug() << "Usage:" << app << "(filename)";
+    qDebug() << "Usage:" << app << "[--frame=N] [--cache] [--color-manage] [--profile=out.json] (filename|directory...)";
+    qDebug() << "      " << app << "[--cache] [--color-manage] --daemon";
+    qDebug() << "With several files or a directory, J and K move between them.";
     qDebug() << "Filename can be - to read data from stdin instead, for example:";
     qDebug() << "   base64 -d foo | qeh -";
+    qDebug() << "--frame=N starts animations paused at frame N";
+    qDebug() << "--cache keeps screen sized copies in $XDG_CACHE_HOME/qeh, to open them faster next time";
+    qDebug() << "--color-manage converts images to the colour profile of the display";
+    qDebug() << "--profile=out.json writes a timeline in the Chrome trace format";
+    qDebug() << "--daemon keeps running, and opens the images later invocations of qeh get";
     if (!verbose) {
         return;
     }
@@ -41,6 +124,26 @@ static void printHelp(const char *app, bool verbose)
 
 int main(int argc, char *argv[])
 {
+    // If a daemon is running it opens it, unless we're the daemon, are
+    // asked to profile ourselves or to show the help.
+    {
+        static const QSet<QByteArray> localArguments = {
+            "--daemon", "-h", "-v", "--help", "--version"
+        };
+        QStringList arguments;
+        bool forward = argc > 1;
+        for (int i = 1; i < argc; i++) {
+            arguments.append(QString::fromLocal8Bit(argv[i]));
+            if (localArguments.contains(argv[i]) || qstrncmp(argv[i], "--profile=", 10) == 0) {
+                forward = false;
+            }
+        }
+        int exitCode = 0;
+        if (forward && Daemon::forward(arguments, &exitCode)) {
+            return exitCode;
+        }
+    }
+
     qunsetenv("QT_QPA_PLATFORMTHEME");
     qputenv("QT_XCB_GL_INTEGRATION", "none");
     qputenv("QT_QPA_PLATFORMTHEME", "generic");
@@ -58,18 +161,32 @@ int main(int argc, char *argv[])
     QElapsedTimer t; t.start();
 #endif
 
+    // Needs to start before the application is created to include that
+    for (int i = 1; i < argc; i++) {
+        if (qstrncmp(argv[i], "--profile=", 10) == 0) {
+            Profiler::start(QString::fromLocal8Bit(argv[i] + 10));
+        }
+    }
+
+#ifdef QEH_STATIC_PLUGINS
+    // The image formats we need are built in, only look for plugins on
+    // disk if we get something else.
+    const QStringList pluginPaths = QCoreApplication::libraryPaths();
+    QCoreApplication::setLibraryPaths(QStringList());
+#endif
+
+    const qint64 applicationStart = Profiler::isEnabled() ? Profiler::now() : 0;
     QGuiApplication a(argc, argv);
-    if (argc != 2) {
-        printHelp(argv[0], false);
-        return 1;
+    if (Profiler::isEnabled()) {
+        Profiler::addSpan("QGuiApplication", applicationStart);
     }
 
-    for (const QString &arg : a.arguments()) {
-        if (arg == "-h" || arg == "-v" || arg == "--help" || arg == "--version") {
-            printHelp(argv[0], true);
-            return 1;
-        }
+    Options options;
+    if (!parseArguments(a.arguments().mid(1), QString(), &options)) {
+        printHelp(argv[0], options.help);
+        return 1;
     }
+
     QSurfaceFormat defaultFormat = QSurfaceFormat::defaultFormat();
     if (!defaultFormat.hasAlpha()) {
         defaultFormat.setAlphaBufferSize(8);
@@ -77,16 +194,99 @@ int main(int argc, char *argv[])
     QSurfaceFormat::setDefaultFormat(defaultFormat);
 
 
-    QFileInfo info(argv[1]);
+    if (options.daemon) {
+        // Windows come and go, but we keep running
+        a.setQuitOnLastWindowClosed(false);
 
-    a.setApplicationDisplayName(info.fileName());
+        Daemon daemon([&](const QString &workingDirectory, const QStringList &arguments, int stdinDescriptor, const Daemon::Reply &reply) {
+            Options request;
+            if (!parseArguments(arguments, workingDirectory, &request) || request.daemon) {
+                if (stdinDescriptor >= 0) {
+                    close(stdinDescriptor);
+                }
+                reply(false);
+                return;
+            }
+            // Only for this window, the next request might not want them
+            Viewer *viewer = new Viewer;
+            viewer->setDiskCacheEnabled(request.cache);
+            viewer->setColorManaged(request.colorManage);
+            if (stdinDescriptor >= 0) {
+                viewer->setInputDescriptor(stdinDescriptor);
+            }
+            viewer->setStartFrame(request.startFrame);
+#ifdef QEH_STATIC_PLUGINS
+            viewer->setFallbackPluginPaths(pluginPaths);
+#endif
+            const auto onProbed = [viewer, reply](bool loaded) {
+                    reply(loaded);
+                    if (!loaded) {
+                        viewer->deleteLater();
+                        return;
+                    }
+                    QObject::connect(viewer, &Viewer::loadingFailed, viewer, &QObject::deleteLater);
+                    QObject::connect(viewer, &QWindow::visibleChanged, viewer, [viewer](bool visible) {
+                            if (!visible) {
+                                viewer->deleteLater();
+                            }
+                        });
+                    viewer->show();
+                };
+            QObject::connect(viewer, &Viewer::probed, viewer, onProbed);
+            if (request.files.count() > 1) {
+                // The window title is set for each file
+                onProbed(viewer->setFiles(request.files));
+            } else {
+                // The input might be a pipe that is slow to write, so we
+                // don't wait for it here.
+                viewer->setTitle(QFileInfo(request.files.first()).fileName());
+                viewer->loadInBackground(request.files.first());
+            }
+        });
+        if (!daemon.listen()) {
+            return 1;
+        }
+        return a.exec();
+    }
 
     Viewer w;
-    if (!w.load(argv[1])) {
-        printHelp(argv[0], w.error() == QImageReader::UnsupportedFormatError);
-        return 1;
+    w.setStartFrame(options.startFrame);
+    w.setDiskCacheEnabled(options.cache);
+    w.setColorManaged(options.colorManage);
+#ifdef QEH_STATIC_PLUGINS
+    w.setFallbackPluginPaths(pluginPaths);
+#endif
+    if (options.files.count() > 1) {
+        // The window title is set for each file
+        if (!w.setFiles(options.files)) {
+            qWarning() << "None of the files could be loaded";
+            return 1;
+        }
+        w.show();
+    } else if (options.files.first() == "-") {
+        // The header might take a while to arrive, so wait for it in the
+        // event loop and show the window once we have it.
+        a.setApplicationDisplayName(options.files.first());
+        const char *app = argv[0];
+        QObject::connect(&w, &Viewer::probed, &a, [&w, app](bool loaded) {
+                if (!loaded) {
+                    printHelp(app, w.error() == QImageReader::UnsupportedFormatError);
+                    QCoreApplication::exit(1);
+                    return;
+                }
+                w.show();
+            });
+        QObject::connect(&w, &Viewer::loadingFailed, &a, []() { QCoreApplication::exit(1); });
+        w.loadInBackground(options.files.first());
+    } else {
+        a.setApplicationDisplayName(QFileInfo(options.files.first()).fileName());
+        if (!w.load(options.files.first())) {
+            printHelp(argv[0], w.error() == QImageReader::UnsupportedFormatError);
+            return 1;
+        }
+        QObject::connect(&w, &Viewer::loadingFailed, &a, []() { QCoreApplication::exit(1); });
+        w.show();
     }
-    w.show();
 #ifdef DEBUG_LAUNCH_TIME
     QTimer::singleShot(0, &a, &QGuiApplication::quit);
     int ret = a.exec();
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Compares startup time of qeh and qeh-static.
+#
+# Usage: ./measure-startup.sh image [runs] [path to static Qt]
+#
+# Both are built with DEBUG_LAUNCH_TIME, so they quit as soon as the window
+# is shown. Run as root to drop the page cache before each run and measure
+# cold starts, otherwise it measures warm starts.
+
+set -e
+
+IMAGE="$1"
+RUNS="${2:-20}"
+STATIC_QT="$3"
+
+if [ -z "$IMAGE" ]; then
+    echo "Usage: $0 image [runs] [path to static Qt]"
+    exit 1
+fi
+
+SOURCE_DIR="$(cd "$(dirname "$0")" && pwd)"
+BUILD_DIR="${BUILD_DIR:-$SOURCE_DIR/startup-build}"
+
+cmake -S "$SOURCE_DIR" -B "$BUILD_DIR/dynamic" -DCMAKE_BUILD_TYPE=Release \
+    -DCMAKE_CXX_FLAGS=-DDEBUG_LAUNCH_TIME > /dev/null
+cmake --build "$BUILD_DIR/dynamic" --target qeh -j"$(nproc)" > /dev/null
+BINARIES="$BUILD_DIR/dynamic/qeh"
+
+if [ -n "$STATIC_QT" ]; then
+    cmake -S "$SOURCE_DIR" -B "$BUILD_DIR/static" -DCMAKE_BUILD_TYPE=Release \
+        -DCMAKE_CXX_FLAGS=-DDEBUG_LAUNCH_TIME -DQEH_STATIC=ON \
+        -DCMAKE_PREFIX_PATH="$STATIC_QT" > /dev/null
+    cmake --build "$BUILD_DIR/static" --target qeh-static -j"$(nproc)" > /dev/null
+    BINARIES="$BINARIES $BUILD_DIR/static/qeh-static"
+else
+    echo "No static Qt given, only measuring qeh"
+fi
+
+for BINARY in $BINARIES; do
+    TIMES=()
+    for _ in $(seq "$RUNS"); do
+        if [ "$(id -u)" -eq 0 ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        START=$(date +%s%N)
+        "$BINARY" "$IMAGE" > /dev/null 2>&1
+        END=$(date +%s%N)
+        TIMES+=($(( (END - START) / 1000000 )))
+    done
+
+    SORTED=($(printf '%s\n' "${TIMES[@]}" | sort -n))
+    COUNT=${#SORTED[@]}
+    echo "$(basename "$BINARY"): min ${SORTED[0]} ms, median ${SORTED[$((COUNT / 2))]} ms, max ${SORTED[$((COUNT - 1))]} ms ($COUNT runs)"
+done
@@ -0,0 +1,83 @@
+#ifndef MIPMAPS_H
+#define MIPMAPS_H
+
+#include "parallel.h"
+
+#include <QImage>
+#include <QVector>
+
+// Averages 2x2 blocks, the source needs to be 32 bit and premultiplied (or
+// not have alpha). Odd rows and columns at the edges are dropped.
+static QImage halveImage(const QImage &source)
+{
+    QImage result(qMax(source.width() / 2, 1), qMax(source.height() / 2, 1), source.format());
+    if (result.isNull()) {
+        return result;
+    }
+    const int width = result.width();
+    const bool singleColumn = source.width() < 2;
+    const bool singleRow = source.height() < 2;
+
+    parallelFor(result.height(), 16, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            const QRgb *top = reinterpret_cast<const QRgb*>(source.constScanLine(singleRow ? 0 : y * 2));
+            const QRgb *bottom = reinterpret_cast<const QRgb*>(source.constScanLine(singleRow ? 0 : y * 2 + 1));
+            QRgb *dest = reinterpret_cast<QRgb*>(result.scanLine(y));
+
+            for (int x = 0; x < width; x++) {
+                const int left = singleColumn ? 0 : x * 2;
+                const int right = singleColumn ? 0 : x * 2 + 1;
+                const quint32 a = top[left], b = top[right], c = bottom[left], d = bottom[right];
+
+                // Two channels at a time, four of them summed fit in 16 bits
+                quint32 rb = (a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) + (d & 0xff00ff);
+                quint32 ag = ((a >> 8) & 0xff00ff) + ((b >> 8) & 0xff00ff) + ((c >> 8) & 0xff00ff) + ((d >> 8) & 0xff00ff);
+                rb = ((rb + 0x20002) >> 2) & 0xff00ff;
+                ag = ((ag + 0x20002) >> 2) & 0xff00ff;
+                dest[x] = rb | (ag << 8);
+            }
+        }
+    });
+
+    return result;
+}
+
+// Level 0 is the original image, every following level is half the size of
+// the previous, down to where it's small enough that it doesn't matter.
+static QVector<QImage> buildMipmaps(const QImage &image)
+{
+    QVector<QImage> levels;
+    if (image.isNull()) {
+        return levels;
+    }
+    levels.append(image);
+
+    QImage level = image.convertToFormat(image.hasAlphaChannel() ?
+                                         QImage::Format_ARGB32_Premultiplied :
+                                         QImage::Format_RGB32);
+    while (level.width() > 64 && level.height() > 64) {
+        level = halveImage(level);
+        if (level.isNull()) {
+            break;
+        }
+        levels.append(level);
+    }
+    return levels;
+}
+
+// Returns the smallest level that is still at least as big as size, so
+// we never have to scale up from a smaller level.
+static QImage bestMipmap(const QVector<QImage> &levels, const QSize &size)
+{
+    if (levels.isEmpty()) {
+        return QImage();
+    }
+    for (int i = levels.count() - 1; i > 0; i--) {
+        if (levels[i].width() >= size.width() && levels[i].height() >= size.height()) {
+            return levels[i];
+        }
+    }
+    return levels.first();
+}
+
+#endif // MIPMAPS_H
@@ -0,0 +1,74 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <QThreadPool>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <functional>
+
+struct ParallelForState
+{
+    std::function<void(int, int)> function;
+    int count = 0;
+    int bandSize = 0;
+    int bandCount = 0;
+
+    QAtomicInt nextBand;
+    QAtomicInt finishedBands;
+    QMutex mutex;
+    QWaitCondition done;
+};
+
+static void runParallelForBands(ParallelForState *state)
+{
+    int band;
+    while ((band = state->nextBand.fetchAndAddRelaxed(1)) < state->bandCount) {
+        const int begin = band * state->bandSize;
+        state->function(begin, qMin(begin + state->bandSize, state->count));
+
+        if (state->finishedBands.fetchAndAddOrdered(1) + 1 == state->bandCount) {
+            QMutexLocker locker(&state->mutex);
+            state->done.wakeAll();
+        }
+    }
+}
+
+// Calls function(begin, end) for bands of [0, count) on the global thread
+// pool, and returns when all are done. The calling thread processes bands
+// as well, so this doesn't deadlock when called from inside the pool.
+static void parallelFor(int count, int minBandSize, const std::function<void(int, int)> &function)
+{
+    if (count <= 0) {
+        return;
+    }
+    QThreadPool *pool = QThreadPool::globalInstance();
+    const int threads = qMax(1, pool->maxThreadCount());
+    const int bandSize = qMax(minBandSize, (count + threads - 1) / threads);
+    if (bandSize >= count) {
+        function(0, count);
+        return;
+    }
+
+    QSharedPointer<ParallelForState> state(new ParallelForState);
+    state->function = function;
+    state->count = count;
+    state->bandSize = bandSize;
+    state->bandCount = (count + bandSize - 1) / bandSize;
+
+    // Helpers that start after everything is done just return, the shared
+    // state keeps them from touching anything that's gone.
+    for (int i = 1; i < state->bandCount; i++) {
+        pool->start([state]() { runParallelForBands(state.data()); });
+    }
+    runParallelForBands(state.data());
+
+    QMutexLocker locker(&state->mutex);
+    while (state->finishedBands.loadAcquire() < state->bandCount) {
+        state->done.wait(&state->mutex);
+    }
+}
+
+#endif // PARALLEL_H